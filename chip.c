@@ -14,12 +14,17 @@
  * (at your option) any later version.
  */
 
+#include <linux/bitops.h>
 #include <linux/module.h>
+#include <linux/pm_runtime.h>
 #include <linux/slab.h>
+#include <linux/version.h>
 #include <sound/initval.h>
 
 #include "chip.h"
 #include "pcm.h"
+#include "stats.h"
+#include "swap.h"
 
 MODULE_AUTHOR("Michael Trimarchi <michael@amarulasolutions.com>");
 MODULE_AUTHOR("Antonio Ospite <ao2@amarulasolutions.com>");
@@ -46,6 +51,7 @@ MODULE_SUPPORTED_DEVICE("{{M2Tech,Young},"
 static int index[SNDRV_CARDS] = SNDRV_DEFAULT_IDX; /* Index 0-max */
 static char *id[SNDRV_CARDS] = SNDRV_DEFAULT_STR; /* Id for card */
 static bool enable[SNDRV_CARDS] = SNDRV_DEFAULT_ENABLE_PNP; /* Enable this card */
+static char *slot_key[SNDRV_CARDS]; /* USB path or serial bound to this slot */
 
 #define DRIVER_NAME "snd-usb-hiface"
 #define CARD_NAME "hiFace"
@@ -56,18 +62,76 @@ module_param_array(id, charp, NULL, 0444);
 MODULE_PARM_DESC(id, "ID string for " CARD_NAME " soundcard.");
 module_param_array(enable, bool, NULL, 0444);
 MODULE_PARM_DESC(enable, "Enable " CARD_NAME " soundcard.");
+module_param_array(slot_key, charp, NULL, 0444);
+MODULE_PARM_DESC(slot_key, "USB path (e.g. 1-1.2) or serial number of the device using this slot.");
 
+static int autosuspend_delay_ms = -1;
+module_param(autosuspend_delay_ms, int, 0444);
+MODULE_PARM_DESC(autosuspend_delay_ms, "Enable autosuspend of an idle device after this delay, negative to leave the power policy to userspace (default: -1).");
+
+/* protects only the slot reservation, probes run in parallel otherwise */
 static DEFINE_MUTEX(register_mutex);
+static DECLARE_BITMAP(devices_used, SNDRV_CARDS);
 
 struct hiface_vendor_quirk {
 	const char *device_name;
 	u8 extra_freq;
 };
 
-static int hiface_chip_create(struct usb_device *device, int idx,
+static bool hiface_chip_slot_matches(struct usb_device *device, int idx)
+{
+	return !strcmp(slot_key[idx], dev_name(&device->dev)) ||
+	       (device->serial && !strcmp(slot_key[idx], device->serial));
+}
+
+/*
+ * Pick the index[]/id[] slot for a device: the one whose slot_key names
+ * it, else the first enabled slot which is not reserved for another one.
+ */
+static int hiface_chip_reserve_slot(struct usb_device *device)
+{
+	int idx;
+
+	mutex_lock(&register_mutex);
+	for (idx = 0; idx < SNDRV_CARDS; idx++)
+		if (enable[idx] && !test_bit(idx, devices_used) &&
+		    slot_key[idx] && hiface_chip_slot_matches(device, idx))
+			goto found;
+
+	for (idx = 0; idx < SNDRV_CARDS; idx++)
+		if (enable[idx] && !test_bit(idx, devices_used) &&
+		    !slot_key[idx])
+			goto found;
+
+	mutex_unlock(&register_mutex);
+	return -ENODEV;
+
+found:
+	set_bit(idx, devices_used);
+	mutex_unlock(&register_mutex);
+	return idx;
+}
+
+static void hiface_chip_release_slot(int idx)
+{
+	mutex_lock(&register_mutex);
+	clear_bit(idx, devices_used);
+	mutex_unlock(&register_mutex);
+}
+
+/* the slot stays taken until the card is gone, maybe after disconnect */
+static void hiface_chip_free(struct snd_card *card)
+{
+	struct hiface_chip *chip = card->private_data;
+
+	hiface_chip_release_slot(chip->index);
+}
+
+static int hiface_chip_create(struct usb_interface *intf, int idx,
 			      const struct hiface_vendor_quirk *quirk,
 			      struct hiface_chip **rchip)
 {
+	struct usb_device *device = interface_to_usbdev(intf);
 	struct snd_card *card = NULL;
 	struct hiface_chip *chip;
 	int ret;
@@ -76,11 +140,19 @@ static int hiface_chip_create(struct usb_device *device, int idx,
 	*rchip = NULL;
 
 	/* if we are here, card can be registered in alsa. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
+	ret = snd_card_new(&intf->dev, index[idx], id[idx], THIS_MODULE,
+			   sizeof(*chip), &card);
+#else
 	ret = snd_card_create(index[idx], id[idx], THIS_MODULE, sizeof(*chip), &card);
+#endif
 	if (ret < 0) {
 		dev_err(&device->dev, "cannot create alsa card.\n");
 		return ret;
 	}
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 15, 0)
+	snd_card_set_dev(card, &intf->dev);
+#endif
 
 	strlcpy(card->driver, DRIVER_NAME, sizeof(card->driver));
 
@@ -97,7 +169,10 @@ static int hiface_chip_create(struct usb_device *device, int idx,
 
 	chip = card->private_data;
 	chip->dev = device;
+	chip->intf = intf;
 	chip->card = card;
+	chip->index = idx;
+	card->private_free = hiface_chip_free;
 
 	*rchip = chip;
 	return 0;
@@ -118,25 +193,18 @@ static int hiface_chip_probe(struct usb_interface *intf,
 		return -EIO;
 	}
 
-	/* check whether the card is already registered */
-	chip = NULL;
-	mutex_lock(&register_mutex);
-
-	for (i = 0; i < SNDRV_CARDS; i++)
-		if (enable[i])
-			break;
-
-	if (i >= SNDRV_CARDS) {
+	i = hiface_chip_reserve_slot(device);
+	if (i < 0) {
 		dev_err(&device->dev, "no available " CARD_NAME " audio device\n");
-		ret = -ENODEV;
-		goto err;
+		return i;
 	}
 
-	ret = hiface_chip_create(device, i, quirk, &chip);
-	if (ret < 0)
-		goto err;
-
-	snd_card_set_dev(chip->card, &intf->dev);
+	/* once the card exists, hiface_chip_free releases the slot */
+	ret = hiface_chip_create(intf, i, quirk, &chip);
+	if (ret < 0) {
+		hiface_chip_release_slot(i);
+		return ret;
+	}
 
 	ret = hiface_pcm_init(chip, quirk ? quirk->extra_freq : 0);
 	if (ret < 0)
@@ -148,15 +216,22 @@ static int hiface_chip_probe(struct usb_interface *intf,
 		goto err_chip_destroy;
 	}
 
-	mutex_unlock(&register_mutex);
-
 	usb_set_intfdata(intf, chip);
+
+	/*
+	 * The pcm holds the device awake while open or streaming. Whether an
+	 * idle one suspends is up to userspace, power/control, unless asked
+	 * for here.
+	 */
+	if (autosuspend_delay_ms >= 0) {
+		pm_runtime_set_autosuspend_delay(&device->dev,
+						 autosuspend_delay_ms);
+		usb_enable_autosuspend(device);
+	}
 	return 0;
 
 err_chip_destroy:
 	snd_card_free(chip->card);
-err:
-	mutex_unlock(&register_mutex);
 	return ret;
 }
 
@@ -178,6 +253,31 @@ static void hiface_chip_disconnect(struct usb_interface *intf)
 	snd_card_free_when_closed(card);
 }
 
+static int hiface_chip_suspend(struct usb_interface *intf,
+			       pm_message_t message)
+{
+	struct hiface_chip *chip = usb_get_intfdata(intf);
+
+	if (!chip || PMSG_IS_AUTO(message))
+		return 0;
+
+	snd_power_change_state(chip->card, SNDRV_CTL_POWER_D3hot);
+	hiface_pcm_suspend(chip);
+	return 0;
+}
+
+static int hiface_chip_resume(struct usb_interface *intf)
+{
+	struct hiface_chip *chip = usb_get_intfdata(intf);
+
+	if (!chip)
+		return 0;
+
+	/* back to D0 once the stream runs, at once after an autosuspend */
+	hiface_pcm_resume(chip);
+	return 0;
+}
+
 static const struct usb_device_id device_table[] = {
 	{
 		USB_DEVICE(0x04b4, 0x0384),
@@ -291,22 +391,35 @@ static struct usb_driver hiface_usb_driver = {
 	.name = DRIVER_NAME,
 	.probe = hiface_chip_probe,
 	.disconnect = hiface_chip_disconnect,
+	.suspend = hiface_chip_suspend,
+	.resume = hiface_chip_resume,
+	.reset_resume = hiface_chip_resume,
 	.id_table = device_table,
+	.supports_autosuspend = 1,
+	/* each device takes a while to set up, do not hold up the others */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+	.drvwrap.driver.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+#endif
 };
 
-#if 0
-module_usb_driver(hiface_usb_driver);
-#else
 static int __init hiface_module_init(void)
 {
-	return usb_register(&hiface_usb_driver);
+	int ret;
+
+	hiface_swap_init();
+	hiface_stats_module_init();
+
+	ret = usb_register(&hiface_usb_driver);
+	if (ret)
+		hiface_stats_module_exit();
+	return ret;
 }
 
 static void __exit hiface_module_exit(void)
 {
 	usb_deregister(&hiface_usb_driver);
+	hiface_stats_module_exit();
 }
 
 module_init(hiface_module_init)
 module_exit(hiface_module_exit)
-#endif
@@ -24,7 +24,9 @@ struct pcm_runtime;
 
 struct hiface_chip {
 	struct usb_device *dev;
+	struct usb_interface *intf;
 	struct snd_card *card;
 	struct pcm_runtime *pcm;
+	int index; /* slot in the index/id/enable module parameters */
 };
 #endif /* HIFACE_CHIP_H */
@@ -0,0 +1,223 @@
+/*
+ * Linux driver for M2Tech hiFace compatible devices
+ *
+ * Copyright 2012-2013 (C) M2TECH S.r.l and Amarula Solutions B.V.
+ *
+ * Authors:  Michael Trimarchi <michael@amarulasolutions.com>
+ *           Antonio Ospite <ao2@amarulasolutions.com>
+ *
+ * The driver is based on the work done in TerraTec DMX 6Fire USB
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/swab.h>
+#include <linux/time.h>
+
+#include "core.h"
+
+/* n is in bytes, a multiple of 4 */
+void hiface_swahw32_scalar(u8 *dest, const u8 *src, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n / 4; i++)
+		((u32 *)dest)[i] = swahw32(((const u32 *)src)[i]);
+}
+
+/*
+ * Narrower formats are widened to 32 bits and swapped in the same pass,
+ * the swap of a left-aligned sample is just a shift to the other half.
+ */
+void hiface_convert_s16(u8 *dest, const u8 *src, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		((u32 *)dest)[i] = ((const u16 *)src)[i];
+}
+
+void hiface_convert_s24(u8 *dest, const u8 *src, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		((u32 *)dest)[i] = swahw32(((const u32 *)src)[i] << 8);
+}
+
+void hiface_convert_s24_3(u8 *dest, const u8 *src, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++, src += 3)
+		((u32 *)dest)[i] = swahw32(src[0] << 8 | src[1] << 16 |
+					   (u32)src[2] << 24);
+}
+
+static inline u32 hiface_dither_rand(u32 *seed)
+{
+	*seed = *seed * 1664525 + 1013904223;
+	return *seed;
+}
+
+/* sample is left-aligned, the result is in device order */
+static inline u32 hiface_gain_sample(struct hiface_gain *g, unsigned int ch,
+				     s32 sample)
+{
+	s64 v = (s64)sample * g->gain[ch];
+
+	if (g->dither) {
+		/*
+		 * Two uniform values of one 24-bit lsb each, centred, plus
+		 * half a lsb so that the truncation rounds.
+		 */
+		v += (s64)(hiface_dither_rand(&g->seed) >> 8) +
+		     (hiface_dither_rand(&g->seed) >> 8) - (1 << 23);
+		v >>= HIFACE_GAIN_SHIFT;
+		if (v > 0x7fffffffLL)
+			v = 0x7fffffffLL;
+		else if (v < -0x80000000LL)
+			v = -0x80000000LL;
+		v &= ~0xffLL;
+	} else {
+		v >>= HIFACE_GAIN_SHIFT;
+	}
+	return swahw32((u32)v);
+}
+
+/* both channels at zero: silence, without the dither */
+static inline bool hiface_gain_mute(u8 *dest, unsigned int n,
+				    const struct hiface_gain *g)
+{
+	if (g->gain[0] || g->gain[1])
+		return false;
+	memset(dest, 0, n * 4);
+	return true;
+}
+
+/*
+ * Convert n samples and apply the gain in the same pass, the samples start
+ * on a frame. The gain is read from a local copy, which cannot alias dest.
+ */
+void hiface_convert_gain_s16(u8 *dest, const u8 *src, unsigned int n,
+			     struct hiface_gain *gain)
+{
+	struct hiface_gain g = *gain;
+	u32 *out = (u32 *)dest;
+	unsigned int i;
+
+	if (hiface_gain_mute(dest, n, &g))
+		return;
+	for (i = 0; i < n; i++)
+		out[i] = hiface_gain_sample(&g, i & 1,
+					    ((const s16 *)src)[i] * 65536);
+	gain->seed = g.seed;
+}
+
+void hiface_convert_gain_s24(u8 *dest, const u8 *src, unsigned int n,
+			     struct hiface_gain *gain)
+{
+	struct hiface_gain g = *gain;
+	u32 *out = (u32 *)dest;
+	unsigned int i;
+
+	if (hiface_gain_mute(dest, n, &g))
+		return;
+	for (i = 0; i < n; i++)
+		out[i] = hiface_gain_sample(&g, i & 1,
+				(s32)(((const u32 *)src)[i] << 8));
+	gain->seed = g.seed;
+}
+
+void hiface_convert_gain_s24_3(u8 *dest, const u8 *src, unsigned int n,
+			       struct hiface_gain *gain)
+{
+	struct hiface_gain g = *gain;
+	u32 *out = (u32 *)dest;
+	unsigned int i;
+
+	if (hiface_gain_mute(dest, n, &g))
+		return;
+	for (i = 0; i < n; i++, src += 3)
+		out[i] = hiface_gain_sample(&g, i & 1,
+				(s32)(src[0] << 8 | src[1] << 16 |
+				      (u32)src[2] << 24));
+	gain->seed = g.seed;
+}
+
+void hiface_convert_gain_s32(u8 *dest, const u8 *src, unsigned int n,
+			     struct hiface_gain *gain)
+{
+	struct hiface_gain g = *gain;
+	u32 *out = (u32 *)dest;
+	unsigned int i;
+
+	if (hiface_gain_mute(dest, n, &g))
+		return;
+	for (i = 0; i < n; i++)
+		out[i] = hiface_gain_sample(&g, i & 1, ((const s32 *)src)[i]);
+	gain->seed = g.seed;
+}
+
+/*
+ * Estimate how far the device got into the data handed over by the last
+ * completion, from the time elapsed since then at the nominal rate. The
+ * result never goes past cur, and it is where the next completion starts
+ * from, so the position stays monotonic across completions. A clock going
+ * back counts as no time, more than a second as one.
+ */
+unsigned int hiface_position_interpolate(unsigned int ring_frames,
+					 unsigned int last, unsigned int cur,
+					 s64 elapsed_ns, unsigned int rate)
+{
+	unsigned int handed = hiface_ring_distance(ring_frames, last, cur);
+	u64 frames;
+
+	if (!handed)
+		return cur;
+
+	if (elapsed_ns < 0)
+		elapsed_ns = 0;
+	else if (elapsed_ns > NSEC_PER_SEC)
+		elapsed_ns = NSEC_PER_SEC;
+	frames = div_u64((u64)elapsed_ns * rate, NSEC_PER_SEC);
+	if (frames > handed)
+		frames = handed;
+
+	return hiface_ring_advance(ring_frames, last, frames);
+}
+
+/*
+ * Convert bytes of the ring from off into one packet, splitting at the
+ * wrap. Returns the ring offset following the data taken. Without a gain
+ * the samples go through convert alone, bit-perfect, with one through
+ * convert_gain, the same format with the volume.
+ */
+unsigned int hiface_ring_fill(u8 *dest, const u8 *ring,
+			      unsigned int ring_bytes, unsigned int off,
+			      unsigned int bytes, unsigned int sample_bytes,
+			      hiface_convert_t convert,
+			      hiface_convert_gain_t convert_gain,
+			      struct hiface_gain *gain)
+{
+	unsigned int len = hiface_ring_span(ring_bytes, off, bytes);
+	unsigned int samples = len / sample_bytes;
+	unsigned int rest = (bytes - len) / sample_bytes;
+
+	if (!gain) {
+		convert(dest, ring + off, samples);
+		if (len < bytes)
+			convert(dest + samples * 4, ring, rest);
+	} else {
+		convert_gain(dest, ring + off, samples, gain);
+		if (len < bytes)
+			convert_gain(dest + samples * 4, ring, rest, gain);
+	}
+
+	return hiface_ring_advance(ring_bytes, off, bytes);
+}
@@ -0,0 +1,127 @@
+/*
+ * Linux driver for M2Tech hiFace compatible devices
+ *
+ * Copyright 2012-2013 (C) M2TECH S.r.l and Amarula Solutions B.V.
+ *
+ * Authors:  Michael Trimarchi <michael@amarulasolutions.com>
+ *           Antonio Ospite <ao2@amarulasolutions.com>
+ *
+ * The driver is based on the work done in TerraTec DMX 6Fire USB
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef HIFACE_CORE_H
+#define HIFACE_CORE_H
+
+#include <linux/types.h>
+
+/*
+ * Streaming logic with no usb or alsa dependency. It is built into the
+ * module and, with the headers in tools/include, into tools/hiface-bench.
+ */
+
+/* convert n samples to the device format: word-swapped 32-bit */
+typedef void (*hiface_convert_t)(u8 *dest, const u8 *src, unsigned int n);
+
+void hiface_swahw32_scalar(u8 *dest, const u8 *src, unsigned int n);
+void hiface_convert_s16(u8 *dest, const u8 *src, unsigned int n);
+void hiface_convert_s24(u8 *dest, const u8 *src, unsigned int n);
+void hiface_convert_s24_3(u8 *dest, const u8 *src, unsigned int n);
+
+/*
+ * Software volume, applied in the conversion pass. The gain is fixed point,
+ * HIFACE_GAIN_UNITY is 0 dB and the maximum. Streams at unity do not go
+ * through it at all, they stay bit-perfect.
+ */
+#define HIFACE_GAIN_SHIFT 16
+#define HIFACE_GAIN_UNITY (1U << HIFACE_GAIN_SHIFT)
+
+struct hiface_gain {
+	u32 gain[2];  /* left, right */
+	bool dither;  /* TPDF dither down to the 24 bits S/PDIF carries */
+	u32 seed;     /* of the dither noise */
+};
+
+/* convert n samples and apply the gain, one per alsa format */
+typedef void (*hiface_convert_gain_t)(u8 *dest, const u8 *src, unsigned int n,
+				      struct hiface_gain *gain);
+
+void hiface_convert_gain_s16(u8 *dest, const u8 *src, unsigned int n,
+			     struct hiface_gain *gain);
+void hiface_convert_gain_s24(u8 *dest, const u8 *src, unsigned int n,
+			     struct hiface_gain *gain);
+void hiface_convert_gain_s24_3(u8 *dest, const u8 *src, unsigned int n,
+			       struct hiface_gain *gain);
+void hiface_convert_gain_s32(u8 *dest, const u8 *src, unsigned int n,
+			     struct hiface_gain *gain);
+
+unsigned int hiface_ring_fill(u8 *dest, const u8 *ring,
+			      unsigned int ring_bytes, unsigned int off,
+			      unsigned int bytes, unsigned int sample_bytes,
+			      hiface_convert_t convert,
+			      hiface_convert_gain_t convert_gain,
+			      struct hiface_gain *gain);
+
+/* how much of bytes from off fits before the end of the ring */
+static inline unsigned int hiface_ring_span(unsigned int ring_bytes,
+					    unsigned int off,
+					    unsigned int bytes)
+{
+	return bytes < ring_bytes - off ? bytes : ring_bytes - off;
+}
+
+/* bytes must not exceed ring_bytes */
+static inline unsigned int hiface_ring_advance(unsigned int ring_bytes,
+					       unsigned int off,
+					       unsigned int bytes)
+{
+	off += bytes;
+	if (off >= ring_bytes)
+		off -= ring_bytes;
+	return off;
+}
+
+/* how far to is ahead of from, going around the ring */
+static inline unsigned int hiface_ring_distance(unsigned int ring_size,
+						unsigned int from,
+						unsigned int to)
+{
+	return to >= from ? to - from : to + ring_size - from;
+}
+
+/*
+ * Position reporting, in frames of a ring of ring_frames: last is where
+ * the data handed over by the last completion starts, cur where it ends.
+ */
+unsigned int hiface_position_interpolate(unsigned int ring_frames,
+					 unsigned int last, unsigned int cur,
+					 s64 elapsed_ns, unsigned int rate);
+
+/* frames in flight that the interpolated position does not cover yet */
+static inline unsigned int hiface_position_delay(unsigned int ring_frames,
+						 unsigned int last,
+						 unsigned int cur,
+						 unsigned int in_flight)
+{
+	unsigned int handed = hiface_ring_distance(ring_frames, last, cur);
+
+	return in_flight > handed ? in_flight - handed : 0;
+}
+
+/* returns the number of periods elapsed, bytes may span several */
+static inline unsigned int hiface_period_advance(unsigned int *period_off,
+						 unsigned int period,
+						 unsigned int bytes)
+{
+	unsigned int periods;
+
+	*period_off += bytes;
+	periods = *period_off / period;
+	*period_off -= periods * period;
+	return periods;
+}
+#endif /* HIFACE_CORE_H */
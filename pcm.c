@@ -14,16 +14,97 @@
  * (at your option) any later version.
  */
 
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/pm_runtime.h>
+#include <linux/scatterlist.h>
+#include <linux/seqlock.h>
 #include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
+#include <sound/control.h>
 #include <sound/pcm.h>
+#include <sound/tlv.h>
 
 #include "pcm.h"
 #include "chip.h"
+#include "compat.h"
+#include "stats.h"
+#include "swap.h"
+
+#define CREATE_TRACE_POINTS
+#include "trace.h"
 
 #define OUT_EP          0x2
 #define PCM_N_URBS      8
 #define PCM_PACKET_SIZE 4096
 #define PCM_BUFFER_SIZE (2 * PCM_N_URBS * PCM_PACKET_SIZE)
+/*
+ * The buffer is one run of pages, see hiface_pcm_init: the largest block
+ * the page allocator hands out, 4 MB with 4 KB pages, over a second at
+ * 384 kHz. Capped where pages are larger.
+ */
+#define PCM_MAX_CONTIGUOUS (PAGE_SIZE << (MAX_ORDER - 1))
+#define PCM_DEEP_BUFFER_SIZE \
+	min_t(size_t, PCM_MAX_CONTIGUOUS, 16 * 1024 * 1024)
+
+/* limits for the per-stream URB geometry chosen in hiface_pcm_prepare */
+#define PCM_MIN_URBS        2
+#define PCM_MAX_URBS        16
+#define PCM_PACKET_ALIGN    512 /* high-speed bulk wMaxPacketSize */
+/*
+ * The urbs in flight share PCM_URB_BUFFER_SIZE, see hiface_pcm_set_geometry:
+ * a long quantum gets fewer, larger urbs. The largest, 20 ms at 384 kHz,
+ * still leaves room for PCM_MIN_URBS.
+ */
+#define PCM_URB_BUFFER_SIZE (128 * 1024)
+#define PCM_MAX_PACKET_SIZE (PCM_URB_BUFFER_SIZE / PCM_MIN_URBS)
+#define PCM_DEEP_PACKET_SIZE (16 * PCM_PACKET_ALIGN)
+#define PCM_SILENCE_OFFSET  PCM_URB_BUFFER_SIZE /* shared zeroes after urbs */
+#define PCM_COHERENT_SIZE   (PCM_URB_BUFFER_SIZE + PCM_MAX_PACKET_SIZE)
+#define PCM_MIN_QUANTUM_US  250
+#define PCM_MAX_QUANTUM_US  20000
+
+/* ring buffer pieces one URB can reference in zero-copy mode: a wrap */
+#define PCM_MAX_SGS         2
+
+/* the device always gets two word-swapped 32-bit samples per frame */
+#define PCM_FRAME_BYTES     8
+
+/* one bulk packet on the device side */
+#define PCM_MIN_PERIOD_FRAMES (PCM_PACKET_ALIGN / PCM_FRAME_BYTES)
+
+/* room for the completion handlers to run before a linked start */
+#define PCM_SYNC_MARGIN_US 1000
+
+/* restart attempts after an urb error, the delay doubles each time */
+#define PCM_RECOVER_ATTEMPTS 6
+#define PCM_RECOVER_DELAY_MS 10
+/* a stream running this long without error gets all its attempts back */
+#define PCM_RECOVER_CLEAN_MS 5000
+
+static unsigned int urb_quantum_us;
+module_param(urb_quantum_us, uint, 0444);
+MODULE_PARM_DESC(urb_quantum_us, "Target duration of one URB in microseconds, 0 for 4096 byte URBs at every rate, read at probe, the URB Quantum us control changes it per card (default: 0).");
+static unsigned int urb_count = PCM_N_URBS;
+module_param(urb_count, uint, 0444);
+MODULE_PARM_DESC(urb_count, "Number of URBs in flight, read at probe, the URB Count control changes it per card (default: 8).");
+static bool zero_copy;
+module_param(zero_copy, bool, 0444);
+MODULE_PARM_DESC(zero_copy, "Swap samples on write and send URBs from the ring buffer, disables mmap (default: no).");
+static unsigned int prealloc_kb;
+module_param(prealloc_kb, uint, 0444);
+MODULE_PARM_DESC(prealloc_kb, "Cap of the buffer preallocated per card in KB, 0 for the largest stream buffer (default: 0).");
+static bool monitor;
+module_param(monitor, bool, 0444);
+MODULE_PARM_DESC(monitor, "Add a capture substream with what is sent to the device (default: no).");
+static bool deep_buffer;
+module_param(deep_buffer, bool, 0444);
+MODULE_PARM_DESC(deep_buffer, "Allow buffers and periods of seconds, for fewer wakeups (default: no).");
+static unsigned int keep_alive_ms = 2000;
+module_param(keep_alive_ms, uint, 0644);
+MODULE_PARM_DESC(keep_alive_ms, "Keep streaming silence this long after close, 0 to stop at once (default: 2000).");
 
 struct pcm_urb {
 	struct hiface_chip *chip;
@@ -31,21 +112,51 @@ struct pcm_urb {
 	struct urb instance;
 	struct usb_anchor submitted;
 	u8 *buffer;
+	dma_addr_t dma;
+	ktime_t submit_time;
+
+	/* zero-copy: ring buffer pieces this urb is sending */
+	struct scatterlist sg[PCM_MAX_SGS];
+	unsigned int ring_bytes;
+
+	unsigned int frames; /* stream frames it carries, 0 for silence */
 };
 
+/*
+ * The lock serializes the writers of the positions, the completion handler
+ * and the stream control paths. hiface_pcm_pointer reads them locklessly
+ * under the seqcount.
+ */
 struct pcm_substream {
 	spinlock_t lock;
+	seqcount_t seq;
 	struct snd_pcm_substream *instance;
 
-	bool active;
-	snd_pcm_uframes_t dma_off;    /* current position in alsa dma_area */
-	snd_pcm_uframes_t period_off; /* current position in current period */
+	bool active;                  /* locked, set by trigger, read per urb */
+	hiface_convert_t convert;     /* alsa format to device format */
+	hiface_convert_gain_t convert_gain; /* the same with the volume */
+	unsigned int sample_bytes;    /* of the alsa format */
+	unsigned int dma_off;         /* current position in alsa dma_area */
+	unsigned int period_off;      /* current position in current period */
+	unsigned int last_off;        /* dma_off before the last completion */
+	ktime_t last_time;            /* time of the last completion */
+	unsigned int queued;          /* zero-copy: ring bytes still in urbs */
+	unsigned int in_flight;       /* frames in urbs, sum of their frames */
+	u64 played;                   /* frames completed since prepare */
+
+	/* linked start, see hiface_pcm_sync_start */
+	bool sync_pending;            /* silence until sync_target */
+	ktime_t sync_target;
+	struct pcm_urb *sync_urb;     /* carries the first frame */
+	s64 sync_offset_ns;           /* of the first frame in sync_urb */
 };
 
 enum { /* pcm streaming states */
-	STREAM_DISABLED, /* no pcm streaming */
-	STREAM_STARTING, /* pcm streaming requested, waiting to become ready */
-	STREAM_RUNNING,  /* pcm streaming running */
+	STREAM_DISABLED,  /* no pcm streaming */
+	STREAM_STARTING,  /* pcm streaming requested, waiting to become ready */
+	STREAM_RUNNING,   /* pcm streaming running */
+	STREAM_SWITCHING, /* urbs draining for a rate or geometry change */
+	STREAM_RECOVERING, /* urb error, restart pending in recover_work */
 	STREAM_STOPPING
 };
 
@@ -54,17 +165,98 @@ struct pcm_runtime {
 	struct snd_pcm *instance;
 
 	struct pcm_substream playback;
+	struct pcm_substream monitor; /* capture of the urb payloads */
 	bool panic; /* if set driver won't do anymore pcm on device */
+	bool zero_copy; /* urbs reference the alsa ring buffer directly */
+	bool deep_buffer; /* buffers up to PCM_DEEP_BUFFER_SIZE */
 
-	struct pcm_urb out_urbs[PCM_N_URBS];
+	struct pcm_urb out_urbs[PCM_MAX_URBS];
+	u8 *out_buffer;           /* coherent backing store of all out urbs */
+	dma_addr_t out_dma;
+	unsigned int rate;        /* rate the device is set to, 0 if unknown */
+	unsigned int n_urbs;      /* URBs used by the current stream */
+	unsigned int packet_size; /* bytes per URB for the current stream */
+
+	/* tunables, applied when the stream is (re)started */
+	unsigned int urb_quantum_us;
+	unsigned int urb_count;
 
 	struct mutex stream_mutex;
-	u8 stream_state; /* one of STREAM_XXX */
+	atomic_t stream_state; /* one of STREAM_XXX, see hiface_pcm_set_state */
 	u8 extra_freq;
 	wait_queue_head_t stream_wait_queue;
 	bool stream_wait_cond;
+
+	/* STREAM_SWITCHING: target settings, protected by playback.lock */
+	struct urb rate_urb;
+	struct usb_ctrlrequest *rate_setup;
+	unsigned int switch_rate;
+	unsigned int switch_n_urbs;
+	unsigned int switch_packet_size;
+	unsigned int parked; /* urbs back from the device, not resubmitted */
+	int switch_err;
+
+	struct delayed_work keep_alive_work; /* stops the stream after close */
+	bool pm_held; /* autopm reference of the stream, see stream_pm_get */
+	unsigned int resume_rate; /* stream to restart after system sleep */
+	struct work_struct resume_work; /* restarts it, see hiface_pcm_resume */
+	ktime_t resume_start;
+
+	/*
+	 * STREAM_RECOVERING: what went wrong. hiface_pcm_recover sets them
+	 * under playback.lock as the stream leaves STREAM_RUNNING, then
+	 * recover_work owns them under stream_mutex until it runs again.
+	 */
+	struct delayed_work recover_work;
+	int recover_err;
+	unsigned int recover_attempts; /* since the stream last ran cleanly */
+	ktime_t recover_start;
+	ktime_t recover_done;  /* when the last restart was made */
+	bool recover_report;   /* xrun not reported to the application yet */
+
+	struct hiface_stats stats;
+
+	/* software volume, protected by playback.lock */
+	struct hiface_gain gain;
+	bool gain_bypass; /* at unity, the stream is sent bit-perfect */
+	unsigned int volume[2];
+	bool mute;
 };
 
+static inline int hiface_pcm_card(struct pcm_runtime *rt)
+{
+	return rt->chip->card->number;
+}
+
+static inline int hiface_pcm_state(struct pcm_runtime *rt)
+{
+	return atomic_read(&rt->stream_state);
+}
+
+/*
+ * The exchange is a full barrier: whoever sees the new state also sees
+ * everything written before it, like the settings of a rate switch.
+ */
+static void hiface_pcm_set_state(struct pcm_runtime *rt, int state)
+{
+	int old = atomic_xchg(&rt->stream_state, state);
+
+	trace_hiface_stream_state(hiface_pcm_card(rt), old, state);
+}
+
+static inline bool hiface_pcm_panicked(struct pcm_runtime *rt)
+{
+	return READ_ONCE(rt->panic);
+}
+
+static void hiface_pcm_set_panic(struct pcm_runtime *rt, const char *reason,
+				 int err)
+{
+	hiface_stats_panic(&rt->stats, reason, err);
+	smp_wmb(); /* the reason is visible once panic is */
+	WRITE_ONCE(rt->panic, true);
+}
+
 static const unsigned int rates[] = { 44100, 48000, 88200, 96000, 176400, 192000,
 				      352800, 384000 };
 static const struct snd_pcm_hw_constraint_list constraints_extra_rates = {
@@ -78,10 +270,17 @@ static const struct snd_pcm_hardware pcm_hw = {
 		SNDRV_PCM_INFO_INTERLEAVED |
 		SNDRV_PCM_INFO_BLOCK_TRANSFER |
 		SNDRV_PCM_INFO_PAUSE |
-		SNDRV_PCM_INFO_MMAP_VALID |
-		SNDRV_PCM_INFO_BATCH,
-
-	.formats = SNDRV_PCM_FMTBIT_S32_LE,
+		SNDRV_PCM_INFO_RESUME |
+		SNDRV_PCM_INFO_SYNC_START |
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+		SNDRV_PCM_INFO_HAS_LINK_ATIME |
+#endif
+		SNDRV_PCM_INFO_MMAP_VALID,
+
+	.formats = SNDRV_PCM_FMTBIT_S16_LE |
+		SNDRV_PCM_FMTBIT_S24_LE |
+		SNDRV_PCM_FMTBIT_S24_3LE |
+		SNDRV_PCM_FMTBIT_S32_LE,
 
 	.rates = SNDRV_PCM_RATE_44100 |
 		SNDRV_PCM_RATE_48000 |
@@ -95,7 +294,32 @@ static const struct snd_pcm_hardware pcm_hw = {
 	.channels_min = 2,
 	.channels_max = 2,
 	.buffer_bytes_max = PCM_BUFFER_SIZE,
-	.period_bytes_min = PCM_PACKET_SIZE,
+	.period_bytes_min = PCM_MIN_PERIOD_FRAMES * 4, /* S16_LE, see open */
+	.period_bytes_max = PCM_BUFFER_SIZE,
+	.periods_min = 2,
+	.periods_max = 1024
+};
+
+/* the urb payloads in sample order, the position moves per urb */
+static const struct snd_pcm_hardware pcm_monitor_hw = {
+	.info = SNDRV_PCM_INFO_MMAP |
+		SNDRV_PCM_INFO_INTERLEAVED |
+		SNDRV_PCM_INFO_BLOCK_TRANSFER |
+		SNDRV_PCM_INFO_BATCH |
+		SNDRV_PCM_INFO_MMAP_VALID,
+	.formats = SNDRV_PCM_FMTBIT_S32_LE,
+	.rates = SNDRV_PCM_RATE_44100 |
+		SNDRV_PCM_RATE_48000 |
+		SNDRV_PCM_RATE_88200 |
+		SNDRV_PCM_RATE_96000 |
+		SNDRV_PCM_RATE_176400 |
+		SNDRV_PCM_RATE_192000,
+	.rate_min = 44100,
+	.rate_max = 192000,
+	.channels_min = 2,
+	.channels_max = 2,
+	.buffer_bytes_max = PCM_BUFFER_SIZE,
+	.period_bytes_min = PCM_PACKET_ALIGN,
 	.period_bytes_max = PCM_BUFFER_SIZE,
 	.periods_min = 2,
 	.periods_max = 1024
@@ -113,44 +337,45 @@ static const struct snd_pcm_hardware pcm_hw = {
 #define HIFACE_RATE_352800 0x58
 #define HIFACE_RATE_384000 0x68
 
-static int hiface_pcm_set_rate(struct pcm_runtime *rt, unsigned int rate)
+static int hiface_pcm_rate_value(unsigned int rate)
 {
-	struct usb_device *device = rt->chip->dev;
-	u16 rate_value;
-	int ret;
-
-	/* We are already sure that the rate is supported here thanks to
-	 * ALSA constraints
-	 */
 	switch (rate) {
 	case 44100:
-		rate_value = HIFACE_RATE_44100;
-		break;
+		return HIFACE_RATE_44100;
 	case 48000:
-		rate_value = HIFACE_RATE_48000;
-		break;
+		return HIFACE_RATE_48000;
 	case 88200:
-		rate_value = HIFACE_RATE_88200;
-		break;
+		return HIFACE_RATE_88200;
 	case 96000:
-		rate_value = HIFACE_RATE_96000;
-		break;
+		return HIFACE_RATE_96000;
 	case 176400:
-		rate_value = HIFACE_RATE_176400;
-		break;
+		return HIFACE_RATE_176400;
 	case 192000:
-		rate_value = HIFACE_RATE_192000;
-		break;
+		return HIFACE_RATE_192000;
 	case 352800:
-		rate_value = HIFACE_RATE_352800;
-		break;
+		return HIFACE_RATE_352800;
 	case 384000:
-		rate_value = HIFACE_RATE_384000;
-		break;
+		return HIFACE_RATE_384000;
 	default:
-		dev_err(&device->dev, "Unsupported rate %d\n", rate);
 		return -EINVAL;
 	}
+}
+
+static int hiface_pcm_set_rate(struct pcm_runtime *rt, unsigned int rate)
+{
+	struct usb_device *device = rt->chip->dev;
+	u16 rate_value;
+	int ret;
+
+	/* We are already sure that the rate is supported here thanks to
+	 * ALSA constraints
+	 */
+	ret = hiface_pcm_rate_value(rate);
+	if (ret < 0) {
+		dev_err(&device->dev, "Unsupported rate %d\n", rate);
+		return ret;
+	}
+	rate_value = ret;
 
 	/*
 	 * USBIO: Vendor 0xb0(wValue=0x0043, wIndex=0x0000)
@@ -160,6 +385,7 @@ static int hiface_pcm_set_rate(struct pcm_runtime *rt, unsigned int rate)
 	 * This control message doesn't have any ack from the
 	 * other side
 	 */
+	rt->rate = 0;
 	ret = usb_control_msg(device, usb_sndctrlpipe(device, 0),
 			      HIFACE_SET_RATE_REQUEST,
 			      USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_OTHER,
@@ -169,9 +395,88 @@ static int hiface_pcm_set_rate(struct pcm_runtime *rt, unsigned int rate)
 		return ret;
 	}
 
+	rt->rate = rate;
 	return 0;
 }
 
+/*
+ * Pick URB size and count for a stream: the size is the configured time
+ * quantum at the stream rate, in whole bulk packets, or PCM_PACKET_SIZE
+ * without a quantum, and never larger than one period so that
+ * period_elapsed is not delayed by the URB granularity.
+ *
+ * Periods shorter than PCM_PACKET_SIZE, the former minimum, are asked for
+ * low latency: only about two of them are queued on the bus. In deep
+ * buffer mode latency does not matter and the urbs are as large as the
+ * period allows, for fewer completions.
+ */
+static void hiface_pcm_urb_geometry(struct pcm_runtime *rt,
+				    struct snd_pcm_runtime *alsa_rt,
+				    unsigned int *n_urbs,
+				    unsigned int *packet_size)
+{
+	unsigned int period_bytes, size;
+	u64 bytes;
+
+	/* only rate * quantum needs 64 bits, divided with div_u64 */
+	size = PCM_PACKET_SIZE;
+	if (rt->urb_quantum_us) {
+		bytes = (u64)alsa_rt->rate * rt->urb_quantum_us;
+		bytes = div_u64(bytes, USEC_PER_SEC) * PCM_FRAME_BYTES;
+		size = min_t(u64, bytes, PCM_MAX_PACKET_SIZE);
+		size = clamp_t(unsigned int, roundup(size, PCM_PACKET_ALIGN),
+			       PCM_PACKET_ALIGN, PCM_MAX_PACKET_SIZE);
+	}
+	if (rt->deep_buffer)
+		size = PCM_DEEP_PACKET_SIZE;
+
+	period_bytes = alsa_rt->period_size * PCM_FRAME_BYTES;
+	if (period_bytes >= PCM_PACKET_ALIGN)
+		size = min(size, rounddown(period_bytes, PCM_PACKET_ALIGN));
+
+	*packet_size = size;
+	*n_urbs = rt->urb_count;
+	if (period_bytes < PCM_PACKET_SIZE)
+		*n_urbs = clamp_t(unsigned int, 2 * period_bytes / size,
+				  PCM_MIN_URBS, rt->urb_count);
+
+	/*
+	 * In zero-copy mode the data in flight is still part of the ring
+	 * buffer, keep at least half of it for the application.
+	 */
+	if (rt->zero_copy) {
+		unsigned int limit = frames_to_bytes(alsa_rt,
+						     alsa_rt->buffer_size) / 2;
+
+		size = min_t(unsigned int, size,
+			     rounddown(limit / PCM_MIN_URBS, PCM_PACKET_ALIGN));
+		*packet_size = max_t(unsigned int, size, PCM_PACKET_ALIGN);
+		*n_urbs = clamp_t(unsigned int, limit / *packet_size,
+				  PCM_MIN_URBS, *n_urbs);
+	}
+
+	/* all of them in the coherent area */
+	*n_urbs = min(*n_urbs, PCM_URB_BUFFER_SIZE / *packet_size);
+}
+
+/*
+ * Lay the urb buffers out for a new geometry, back to back in the coherent
+ * area. Call with no urb in flight.
+ */
+static void hiface_pcm_set_geometry(struct pcm_runtime *rt,
+				    unsigned int n_urbs,
+				    unsigned int packet_size)
+{
+	unsigned int i;
+
+	rt->n_urbs = n_urbs;
+	rt->packet_size = packet_size;
+	for (i = 0; i < n_urbs; i++) {
+		rt->out_urbs[i].buffer = rt->out_buffer + i * packet_size;
+		rt->out_urbs[i].dma = rt->out_dma + i * packet_size;
+	}
+}
+
 static struct pcm_substream *hiface_pcm_get_substream(struct snd_pcm_substream
 						      *alsa_sub)
 {
@@ -185,15 +490,154 @@ static struct pcm_substream *hiface_pcm_get_substream(struct snd_pcm_substream
 	return NULL;
 }
 
+/* send the urb from its own buffer */
+static void hiface_pcm_urb_use_buffer(struct pcm_urb *urb)
+{
+	urb->instance.sg = NULL;
+	urb->instance.num_sgs = 0;
+	urb->instance.transfer_buffer = urb->buffer;
+	urb->instance.transfer_dma = urb->dma;
+	urb->instance.transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+}
+
+/* send silence from the zeroes shared by all urbs, the device only reads it */
+static void hiface_pcm_urb_use_silence(struct pcm_runtime *rt,
+				       struct pcm_urb *urb)
+{
+	urb->instance.sg = NULL;
+	urb->instance.num_sgs = 0;
+	urb->instance.transfer_buffer = rt->out_buffer + PCM_SILENCE_OFFSET;
+	urb->instance.transfer_dma = rt->out_dma + PCM_SILENCE_OFFSET;
+	urb->instance.transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	urb->frames = 0;
+}
+
+/*
+ * Zero-copy: send packet_bytes of the ring buffer from dma_off in place,
+ * split at the wrap. The ring is physically contiguous, see hiface_pcm_init,
+ * and the usb core maps the pages.
+ *
+ * call with substream locked
+ */
+static void hiface_pcm_urb_use_ring(struct pcm_substream *sub,
+				    struct pcm_urb *urb,
+				    unsigned int packet_bytes)
+{
+	struct snd_pcm_runtime *alsa_rt = sub->instance->runtime;
+	unsigned int buffer_bytes = snd_pcm_lib_buffer_bytes(sub->instance);
+	unsigned int off = sub->dma_off;
+	unsigned int left = packet_bytes;
+	unsigned int n = 0;
+
+	sg_init_table(urb->sg, PCM_MAX_SGS);
+	while (left) {
+		u8 *addr = alsa_rt->dma_area + off;
+		unsigned int len;
+
+		len = min(left, buffer_bytes - off);
+		sg_set_page(&urb->sg[n++], virt_to_page(addr), len,
+			    offset_in_page(addr));
+
+		off += len;
+		if (off == buffer_bytes)
+			off = 0;
+		left -= len;
+	}
+	sg_mark_end(&urb->sg[n - 1]);
+
+	urb->instance.sg = urb->sg;
+	urb->instance.num_sgs = n;
+	urb->instance.transfer_buffer = NULL;
+	urb->instance.transfer_flags &= ~URB_NO_TRANSFER_DMA_MAP;
+
+	urb->ring_bytes = packet_bytes;
+}
+
+/* zero-copy: wait until no urb references the ring buffer anymore */
+static bool hiface_pcm_wait_ring_idle(struct pcm_runtime *rt)
+{
+	if (!rt->zero_copy)
+		return true;
+
+	return wait_event_timeout(rt->stream_wait_queue,
+				  !READ_ONCE(rt->playback.queued), HZ) > 0;
+}
+
+/*
+ * Wake the device up for an open substream, it autosuspends again once it
+ * is closed and no stream runs anymore.
+ */
+static int hiface_pcm_autoresume(struct pcm_runtime *rt)
+{
+	struct usb_interface *intf = rt->chip->intf;
+	bool suspended = pm_runtime_suspended(&intf->dev);
+	ktime_t start = ktime_get();
+	int ret;
+
+	ret = usb_autopm_get_interface(intf);
+	if (ret < 0)
+		return ret;
+
+	if (suspended)
+		hiface_stats_resumed(&rt->stats,
+				     ktime_us_delta(ktime_get(), start));
+	return 0;
+}
+
+/* a running stream keeps the device awake, also with no substream open */
+static int hiface_pcm_stream_pm_get(struct pcm_runtime *rt)
+{
+	int ret;
+
+	if (rt->pm_held)
+		return 0;
+
+	ret = usb_autopm_get_interface(rt->chip->intf);
+	if (ret < 0)
+		return ret;
+
+	rt->pm_held = true;
+	return 0;
+}
+
+static void hiface_pcm_stream_pm_put(struct pcm_runtime *rt)
+{
+	if (rt->pm_held) {
+		usb_autopm_put_interface(rt->chip->intf);
+		rt->pm_held = false;
+	}
+}
+
+static int hiface_pcm_submit_urb(struct pcm_runtime *rt, struct pcm_urb *urb)
+{
+	int ret;
+
+	urb->submit_time = ktime_get();
+	ret = usb_submit_urb(&urb->instance, GFP_ATOMIC);
+	trace_hiface_urb_submit(hiface_pcm_card(rt), urb - rt->out_urbs,
+				urb->instance.transfer_buffer_length, ret);
+	if (ret)
+		hiface_stats_submit_error(&rt->stats, ret);
+	else
+		hiface_stats_submitted(&rt->stats);
+	return ret;
+}
+
 /* call with stream_mutex locked */
 static void hiface_pcm_stream_stop(struct pcm_runtime *rt)
 {
 	int i, time;
 
-	if (rt->stream_state != STREAM_DISABLED) {
-		rt->stream_state = STREAM_STOPPING;
+	if (hiface_pcm_state(rt) != STREAM_DISABLED) {
+		spin_lock_irq(&rt->playback.lock);
+		hiface_pcm_set_state(rt, STREAM_STOPPING);
+		spin_unlock_irq(&rt->playback.lock);
+
+		/* a rate switch resumes the urbs from this completion */
+		usb_kill_urb(&rt->rate_urb);
 
-		for (i = 0; i < PCM_N_URBS; i++) {
+		/* the urb count may be changing under a rate switch */
+		for (i = 0; i < PCM_MAX_URBS; i++) {
 			time = usb_wait_anchor_empty_timeout(
 					&rt->out_urbs[i].submitted, 100);
 			if (!time)
@@ -202,8 +646,35 @@ static void hiface_pcm_stream_stop(struct pcm_runtime *rt)
 			usb_kill_urb(&rt->out_urbs[i].instance);
 		}
 
-		rt->stream_state = STREAM_DISABLED;
+		/*
+		 * Killed urbs do not release their ring data or count their
+		 * frames out of in_flight. The ring data was never played
+		 * either: take it back, so that a restart after a suspend
+		 * sends it again and the pointer does not jump ahead.
+		 */
+		spin_lock_irq(&rt->playback.lock);
+		write_seqcount_begin(&rt->playback.seq);
+		for (i = 0; i < PCM_MAX_URBS; i++) {
+			rt->out_urbs[i].ring_bytes = 0;
+			rt->out_urbs[i].frames = 0;
+		}
+		if (rt->playback.queued && rt->playback.instance) {
+			unsigned int ring_bytes =
+				snd_pcm_lib_buffer_bytes(rt->playback.instance);
+
+			rt->playback.dma_off = hiface_ring_advance(ring_bytes,
+					rt->playback.dma_off,
+					ring_bytes - rt->playback.queued);
+			rt->playback.last_off = rt->playback.dma_off;
+		}
+		rt->playback.queued = 0;
+		rt->playback.in_flight = 0;
+		write_seqcount_end(&rt->playback.seq);
+		spin_unlock_irq(&rt->playback.lock);
+
+		hiface_pcm_set_state(rt, STREAM_DISABLED);
 	}
+	hiface_pcm_stream_pm_put(rt);
 }
 
 /* call with stream_mutex locked */
@@ -212,19 +683,27 @@ static int hiface_pcm_stream_start(struct pcm_runtime *rt)
 	int ret = 0;
 	int i;
 
-	if (rt->stream_state == STREAM_DISABLED) {
+	if (hiface_pcm_state(rt) == STREAM_DISABLED) {
+		ret = hiface_pcm_stream_pm_get(rt);
+		if (ret < 0)
+			return ret;
 
 		/* reset panic state when starting a new stream */
-		rt->panic = false;
+		WRITE_ONCE(rt->panic, false);
+
+		/* only a completion of these urbs counts, not the last stream's */
+		rt->stream_wait_cond = false;
 
 		/* submit our out urbs zero init */
-		rt->stream_state = STREAM_STARTING;
-		for (i = 0; i < PCM_N_URBS; i++) {
-			memset(rt->out_urbs[i].buffer, 0, PCM_PACKET_SIZE);
+		hiface_pcm_set_state(rt, STREAM_STARTING);
+		hiface_stats_stream_start(&rt->stats);
+		for (i = 0; i < rt->n_urbs; i++) {
+			hiface_pcm_urb_use_silence(rt, &rt->out_urbs[i]);
+			rt->out_urbs[i].instance.transfer_buffer_length =
+				rt->packet_size;
 			usb_anchor_urb(&rt->out_urbs[i].instance,
 				       &rt->out_urbs[i].submitted);
-			ret = usb_submit_urb(&rt->out_urbs[i].instance,
-					     GFP_ATOMIC);
+			ret = hiface_pcm_submit_urb(rt, &rt->out_urbs[i]);
 			if (ret) {
 				hiface_pcm_stream_stop(rt);
 				return ret;
@@ -238,7 +717,7 @@ static int hiface_pcm_stream_start(struct pcm_runtime *rt)
 			struct device *device = &rt->chip->dev->dev;
 			dev_dbg(device, "%s: Stream is running wakeup event\n",
 				 __func__);
-			rt->stream_state = STREAM_RUNNING;
+			hiface_pcm_set_state(rt, STREAM_RUNNING);
 		} else {
 			hiface_pcm_stream_stop(rt);
 			return -EIO;
@@ -247,270 +726,1439 @@ static int hiface_pcm_stream_start(struct pcm_runtime *rt)
 	return ret;
 }
 
-/* The hardware wants word-swapped 32-bit values */
-static void memcpy_swahw32(u8 *dest, u8 *src, unsigned int n)
+/*
+ * Resubmit the parked urbs with the new settings, from atomic context.
+ *
+ * call with substream locked
+ */
+static void hiface_pcm_switch_resume(struct pcm_runtime *rt)
 {
-	unsigned int i;
-
-	for (i = 0; i < n / 4; i++)
-		((u32 *)dest)[i] = swahw32(((u32 *)src)[i]);
-}
+	int ret;
+	int i;
 
-/* call with substream locked */
-/* returns true if a period elapsed */
-static bool hiface_pcm_playback(struct pcm_substream *sub, struct pcm_urb *urb)
-{
-	struct snd_pcm_runtime *alsa_rt = sub->instance->runtime;
-	struct device *device = &urb->chip->dev->dev;
-	u8 *source;
-	unsigned int pcm_buffer_size;
+	/* the stream may have been stopped meanwhile */
+	if (hiface_pcm_state(rt) != STREAM_SWITCHING)
+		return;
 
-	WARN_ON(alsa_rt->format != SNDRV_PCM_FORMAT_S32_LE);
+	hiface_pcm_set_geometry(rt, rt->switch_n_urbs, rt->switch_packet_size);
+	hiface_pcm_set_state(rt, STREAM_RUNNING);
 
-	pcm_buffer_size = snd_pcm_lib_buffer_bytes(sub->instance);
+	for (i = 0; i < rt->n_urbs; i++) {
+		hiface_pcm_urb_use_silence(rt, &rt->out_urbs[i]);
+		rt->out_urbs[i].instance.transfer_buffer_length =
+			rt->packet_size;
+		ret = hiface_pcm_submit_urb(rt, &rt->out_urbs[i]);
+		if (ret) {
+			rt->switch_err = ret;
+			break;
+		}
+	}
+	wake_up(&rt->stream_wait_queue);
+}
 
-	if (sub->dma_off + PCM_PACKET_SIZE <= pcm_buffer_size) {
-		dev_dbg(device, "%s: (1) buffer_size %#x dma_offset %#x\n", __func__,
-			 (unsigned int) pcm_buffer_size,
-			 (unsigned int) sub->dma_off);
+static void hiface_pcm_rate_urb_handler(struct urb *usb_urb)
+{
+	struct pcm_runtime *rt = usb_urb->context;
+	unsigned long flags;
 
-		source = alsa_rt->dma_area + sub->dma_off;
-		memcpy_swahw32(urb->buffer, source, PCM_PACKET_SIZE);
+	spin_lock_irqsave(&rt->playback.lock, flags);
+	if (usb_urb->status) {
+		rt->switch_err = usb_urb->status;
+		wake_up(&rt->stream_wait_queue);
 	} else {
-		/* wrap around at end of ring buffer */
-		unsigned int len;
-
-		dev_dbg(device, "%s: (2) buffer_size %#x dma_offset %#x\n", __func__,
-			 (unsigned int) pcm_buffer_size,
-			 (unsigned int) sub->dma_off);
-
-		len = pcm_buffer_size - sub->dma_off;
-
-		source = alsa_rt->dma_area + sub->dma_off;
-		memcpy_swahw32(urb->buffer, source, len);
-
-		source = alsa_rt->dma_area;
-		memcpy_swahw32(urb->buffer + len, source,
-			       PCM_PACKET_SIZE - len);
-	}
-	sub->dma_off += PCM_PACKET_SIZE;
-	if (sub->dma_off >= pcm_buffer_size)
-		sub->dma_off -= pcm_buffer_size;
-
-	sub->period_off += PCM_PACKET_SIZE;
-	if (sub->period_off >= alsa_rt->period_size) {
-		sub->period_off %= alsa_rt->period_size;
-		return true;
+		rt->rate = rt->switch_rate;
+		hiface_pcm_switch_resume(rt);
 	}
-	return false;
+	spin_unlock_irqrestore(&rt->playback.lock, flags);
 }
 
-static void hiface_pcm_out_urb_handler(struct urb *usb_urb)
+/*
+ * All urbs are back: send the new rate, when it changed, between the
+ * last data and the first urb of the new stream.
+ *
+ * call with substream locked
+ */
+static void hiface_pcm_switch_parked(struct pcm_runtime *rt)
 {
-	struct pcm_urb *out_urb = usb_urb->context;
-	struct pcm_runtime *rt = out_urb->chip->pcm;
-	struct pcm_substream *sub;
-	bool do_period_elapsed = false;
-	unsigned long flags;
+	struct usb_device *device = rt->chip->dev;
 	int ret;
 
-	if (rt->panic || rt->stream_state == STREAM_STOPPING)
+	if (rt->switch_rate == rt->rate) {
+		hiface_pcm_switch_resume(rt);
 		return;
-
-	if (unlikely(usb_urb->status == -ENOENT ||	/* unlinked */
-		     usb_urb->status == -ENODEV ||	/* device removed */
-		     usb_urb->status == -ECONNRESET ||	/* unlinked */
-		     usb_urb->status == -ESHUTDOWN)) {	/* device disabled */
-		goto out_fail;
 	}
 
-	if (rt->stream_state == STREAM_STARTING) {
-		rt->stream_wait_cond = true;
+	rt->rate = 0;
+	rt->rate_setup->wValue =
+		cpu_to_le16(hiface_pcm_rate_value(rt->switch_rate));
+	usb_fill_control_urb(&rt->rate_urb, device,
+			     usb_sndctrlpipe(device, 0),
+			     (unsigned char *)rt->rate_setup, NULL, 0,
+			     hiface_pcm_rate_urb_handler, rt);
+	ret = usb_submit_urb(&rt->rate_urb, GFP_ATOMIC);
+	if (ret) {
+		rt->switch_err = ret;
 		wake_up(&rt->stream_wait_queue);
 	}
+}
 
-	/* now send our playback data (if a free out urb was found) */
-	sub = &rt->playback;
-	spin_lock_irqsave(&sub->lock, flags);
-	if (sub->active)
-		do_period_elapsed = hiface_pcm_playback(sub, out_urb);
-	else
-		memset(out_urb->buffer, 0, PCM_PACKET_SIZE);
+/*
+ * Change rate and urb geometry of a running stream: the completion handler
+ * stops resubmitting, the last urb to come back sends the new rate, and
+ * the urbs are resubmitted as soon as it is acknowledged.
+ *
+ * call with stream_mutex locked
+ */
+static int hiface_pcm_stream_switch(struct pcm_runtime *rt, unsigned int rate,
+				    unsigned int n_urbs,
+				    unsigned int packet_size)
+{
+	spin_lock_irq(&rt->playback.lock);
+	rt->switch_rate = rate;
+	rt->switch_n_urbs = n_urbs;
+	rt->switch_packet_size = packet_size;
+	rt->switch_err = 0;
+	rt->parked = 0;
+	hiface_pcm_set_state(rt, STREAM_SWITCHING);
+	spin_unlock_irq(&rt->playback.lock);
+
+	if (!wait_event_timeout(rt->stream_wait_queue,
+				hiface_pcm_state(rt) != STREAM_SWITCHING ||
+				rt->switch_err, HZ))
+		return -ETIMEDOUT;
+
+	return rt->switch_err;
+}
 
-	spin_unlock_irqrestore(&sub->lock, flags);
+/* bytes and period_off are in the alsa buffer, like dma_off */
+/* call with substream locked */
+/* returns the number of periods elapsed */
+static unsigned int hiface_pcm_period_advance(struct pcm_substream *sub,
+				      unsigned int bytes)
+{
+	return hiface_period_advance(&sub->period_off,
+				     snd_pcm_lib_period_bytes(sub->instance),
+				     bytes);
+}
 
-	if (do_period_elapsed)
-		snd_pcm_period_elapsed(sub->instance);
+/*
+ * The application fell behind if the urb takes more than what it wrote
+ * ahead of the last reported position, minus what urbs already took.
+ *
+ * call with substream locked
+ */
+static bool hiface_pcm_underrun(struct pcm_substream *sub,
+				snd_pcm_uframes_t frames)
+{
+	struct snd_pcm_runtime *alsa_rt = sub->instance->runtime;
+	snd_pcm_uframes_t pos = alsa_rt->status->hw_ptr % alsa_rt->buffer_size;
+	snd_pcm_uframes_t cur = bytes_to_frames(alsa_rt, sub->dma_off);
+	snd_pcm_uframes_t lead;
 
-	ret = usb_submit_urb(&out_urb->instance, GFP_ATOMIC);
-	if (ret < 0)
-		goto out_fail;
+	if (cur >= pos)
+		lead = cur - pos;
+	else
+		lead = cur + alsa_rt->buffer_size - pos;
 
-	return;
+	return snd_pcm_playback_hw_avail(alsa_rt) < lead + frames;
+}
 
-out_fail:
-	rt->panic = true;
+/* duration of one urb of the current stream */
+static s64 hiface_pcm_urb_ns(struct pcm_runtime *rt)
+{
+	if (!rt->rate)
+		return 0;
+	return div_u64((u64)(rt->packet_size / PCM_FRAME_BYTES) * NSEC_PER_SEC,
+		       rt->rate);
 }
 
-static int hiface_pcm_open(struct snd_pcm_substream *alsa_sub)
+/*
+ * Linked start: silence before the first frame so that it plays at
+ * sync_target. The urb filled now plays once the n_urbs - 1 urbs queued
+ * ahead of it are done. Zero-copy urbs cannot start in the middle, they
+ * start on the urb boundary nearest to the target.
+ *
+ * call with substream locked
+ * returns the device samples of silence to send first, all of them while
+ * the target is further away than this urb
+ */
+static unsigned int hiface_pcm_sync_skip(struct pcm_runtime *rt,
+					 struct pcm_substream *sub,
+					 struct pcm_urb *urb,
+					 unsigned int samples)
 {
-	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
-	struct pcm_substream *sub = NULL;
-	struct snd_pcm_runtime *alsa_rt = alsa_sub->runtime;
-	int ret;
+	unsigned int frames = samples / 2;
+	ktime_t start = ktime_add_ns(ktime_get(),
+				     (rt->n_urbs - 1) * hiface_pcm_urb_ns(rt));
+	s64 ahead = ktime_to_ns(ktime_sub(sub->sync_target, start));
+	unsigned int skip = 0;
+
+	if (ahead > 0)
+		skip = min_t(u64, div_u64((u64)ahead * rt->rate,
+					  NSEC_PER_SEC), frames);
+	if (rt->zero_copy)
+		skip = skip * 2 >= frames ? frames : 0;
+	if (skip == frames)
+		return samples;
+
+	sub->sync_pending = false;
+	sub->sync_urb = urb;
+	sub->sync_offset_ns = div_u64((u64)skip * NSEC_PER_SEC, rt->rate);
+	return skip * 2;
+}
 
-	if (rt->panic)
-		return -EPIPE;
+/*
+ * The urb with the first frame of a linked start is done: it played
+ * during the urb duration before now, which tells how far from the
+ * target the first frame really was.
+ *
+ * call with substream locked
+ */
+static void hiface_pcm_sync_done(struct pcm_runtime *rt,
+				 struct pcm_substream *sub, ktime_t now)
+{
+	s64 offset = sub->sync_offset_ns - hiface_pcm_urb_ns(rt);
+	ktime_t first;
 
-	mutex_lock(&rt->stream_mutex);
-	alsa_rt->hw = pcm_hw;
+	/* the ktime helpers take unsigned nanoseconds */
+	if (offset < 0)
+		first = ktime_sub_ns(now, -offset);
+	else
+		first = ktime_add_ns(now, offset);
 
-	if (alsa_sub->stream == SNDRV_PCM_STREAM_PLAYBACK)
+	hiface_stats_sync_start(&rt->stats,
+				ktime_us_delta(first, sub->sync_target));
+	sub->sync_urb = NULL;
+}
+
+/*
+ * The urb is filled first and the positions move once it is ready, so
+ * that a lockless pointer read does not retry for a whole conversion.
+ *
+ * call with substream locked
+ * returns the number of periods elapsed
+ */
+static unsigned int hiface_pcm_playback(struct pcm_substream *sub,
+					struct pcm_urb *urb)
+{
+	struct snd_pcm_runtime *alsa_rt = sub->instance->runtime;
+	struct pcm_runtime *rt = urb->chip->pcm;
+	unsigned int samples = urb->instance.transfer_buffer_length / 4;
+	unsigned int skip = 0; /* device samples of silence first */
+	unsigned int packet_bytes;
+	unsigned int pcm_buffer_size;
+	unsigned int periods = 0;
+	unsigned int dma_off;
+	ktime_t now;
+
+	if (unlikely(sub->sync_pending)) {
+		skip = hiface_pcm_sync_skip(rt, sub, urb, samples);
+		if (skip == samples) {
+			hiface_pcm_urb_use_silence(rt, urb);
+			return 0;
+		}
+	}
+
+	packet_bytes = samples_to_bytes(alsa_rt, samples - skip);
+	pcm_buffer_size = snd_pcm_lib_buffer_bytes(sub->instance);
+
+	if (hiface_pcm_underrun(sub, bytes_to_frames(alsa_rt, packet_bytes)))
+		hiface_stats_underrun(&rt->stats);
+
+	now = ktime_get();
+	urb->frames = bytes_to_frames(alsa_rt, packet_bytes);
+
+	if (rt->zero_copy) {
+		/* already in device order, see hiface_pcm_copy */
+		hiface_pcm_urb_use_ring(sub, urb, packet_bytes);
+		dma_off = hiface_ring_advance(pcm_buffer_size, sub->dma_off,
+					      packet_bytes);
+	} else {
+		hiface_pcm_urb_use_buffer(urb);
+		memset(urb->buffer, 0, skip * 4);
+		dma_off = hiface_ring_fill(urb->buffer + skip * 4,
+					   alsa_rt->dma_area,
+					   pcm_buffer_size, sub->dma_off,
+					   packet_bytes, sub->sample_bytes,
+					   sub->convert, sub->convert_gain,
+					   rt->gain_bypass ? NULL : &rt->gain);
+	}
+
+	write_seqcount_begin(&sub->seq);
+	sub->last_off = sub->dma_off;
+	sub->last_time = now;
+	sub->dma_off = dma_off;
+	sub->in_flight += urb->frames;
+	/* in zero-copy mode periods are counted when urbs give the data back */
+	if (rt->zero_copy)
+		sub->queued += packet_bytes;
+	else
+		periods = hiface_pcm_period_advance(sub, packet_bytes);
+	write_seqcount_end(&sub->seq);
+
+	return periods;
+}
+
+/*
+ * Zero-copy: the ring data sent by this urb is consumed, the application
+ * may overwrite it now.
+ *
+ * call with substream locked
+ * returns the number of periods elapsed
+ */
+static unsigned int hiface_pcm_release(struct pcm_runtime *rt,
+			       struct pcm_substream *sub,
+			       struct pcm_urb *urb, bool active)
+{
+	unsigned int bytes = urb->ring_bytes;
+
+	urb->ring_bytes = 0;
+	sub->queued -= bytes;
+	if (!sub->queued)
+		wake_up(&rt->stream_wait_queue);
+
+	return active ? hiface_pcm_period_advance(sub, bytes) : 0;
+}
+
+/* the first restart is immediate, the next ones back off */
+static unsigned long hiface_pcm_recover_delay(struct pcm_runtime *rt)
+{
+	if (!rt->recover_attempts)
+		return 0;
+	return msecs_to_jiffies(PCM_RECOVER_DELAY_MS << rt->recover_attempts);
+}
+
+/*
+ * An urb failed but the device is still there: stop resubmitting and let
+ * hiface_pcm_recover_work restart the stream. A stream that fails again
+ * soon after a restart keeps counting its attempts, so that a link which
+ * never holds up ends in a panic rather than in endless restarts.
+ */
+static void hiface_pcm_recover(struct pcm_runtime *rt, int err)
+{
+	unsigned long flags;
+	ktime_t now;
+
+	spin_lock_irqsave(&rt->playback.lock, flags);
+	switch (hiface_pcm_state(rt)) {
+	case STREAM_RUNNING:
+		now = ktime_get();
+		if (ktime_to_ms(ktime_sub(now, rt->recover_done)) >=
+		    PCM_RECOVER_CLEAN_MS)
+			rt->recover_attempts = 0;
+		rt->recover_err = err;
+		rt->recover_start = now;
+		rt->recover_report = true;
+		hiface_pcm_set_state(rt, STREAM_RECOVERING);
+		schedule_delayed_work(&rt->recover_work,
+				      hiface_pcm_recover_delay(rt));
+		break;
+	case STREAM_SWITCHING:
+		/* hiface_pcm_prepare restarts the stream */
+		if (!rt->switch_err)
+			rt->switch_err = err;
+		wake_up(&rt->stream_wait_queue);
+		break;
+	default:
+		/* a starting stream times out in hiface_pcm_stream_start */
+		break;
+	}
+	spin_unlock_irqrestore(&rt->playback.lock, flags);
+}
+
+/* copy to the monitor ring in sample order, zeroes if src is NULL */
+/* call with the monitor locked */
+static void hiface_pcm_monitor_copy(struct pcm_substream *sub,
+				    const u8 *src, unsigned int bytes)
+{
+	u8 *ring = sub->instance->runtime->dma_area;
+	unsigned int ring_bytes = snd_pcm_lib_buffer_bytes(sub->instance);
+
+	while (bytes) {
+		unsigned int len = hiface_ring_span(ring_bytes, sub->dma_off,
+						    bytes);
+
+		if (src) {
+			hiface_memcpy_swahw32(ring + sub->dma_off, src, len);
+			src += len;
+		} else {
+			memset(ring + sub->dma_off, 0, len);
+		}
+		sub->dma_off = hiface_ring_advance(ring_bytes, sub->dma_off,
+						   len);
+		bytes -= len;
+	}
+}
+
+/*
+ * Monitor: mirror what the urb sent to the capture substream. Called on
+ * completion, before the urb is refilled and, in zero-copy mode, before
+ * its ring data is given back. Nothing is copied without a running
+ * capture, and alsa stops a capture that is not read with an overrun.
+ *
+ * returns the number of capture periods elapsed
+ */
+static unsigned int hiface_pcm_monitor(struct pcm_runtime *rt,
+				       struct pcm_urb *urb)
+{
+	struct pcm_substream *sub = &rt->monitor;
+	struct urb *usb_urb = &urb->instance;
+	unsigned int bytes = usb_urb->actual_length;
+	unsigned int periods = 0;
+	unsigned long flags;
+
+	if (!READ_ONCE(sub->active))
+		return 0;
+
+	spin_lock_irqsave(&sub->lock, flags);
+	if (!sub->active)
+		goto out;
+
+	if (usb_urb->num_sgs) {
+		struct scatterlist *sg;
+		unsigned int left = bytes;
+		int i;
+
+		for_each_sg(usb_urb->sg, sg, usb_urb->num_sgs, i) {
+			unsigned int len = min(left, sg->length);
+
+			hiface_pcm_monitor_copy(sub, sg_virt(sg), len);
+			left -= len;
+		}
+	} else if (usb_urb->transfer_buffer ==
+		   rt->out_buffer + PCM_SILENCE_OFFSET) {
+		hiface_pcm_monitor_copy(sub, NULL, bytes);
+	} else {
+		hiface_pcm_monitor_copy(sub, usb_urb->transfer_buffer, bytes);
+	}
+	periods = hiface_pcm_period_advance(sub, bytes);
+out:
+	spin_unlock_irqrestore(&sub->lock, flags);
+	return periods;
+}
+
+/*
+ * One call covers all the periods an urb completed: alsa reads the new
+ * position back through the pointer callback and accounts every period
+ * boundary it crossed.
+ */
+static void hiface_pcm_period_elapsed(struct pcm_runtime *rt,
+				      struct pcm_substream *sub,
+				      unsigned int periods)
+{
+	trace_hiface_period_elapsed(hiface_pcm_card(rt), periods,
+				    sub->dma_off);
+	snd_pcm_period_elapsed(sub->instance);
+}
+
+static void hiface_pcm_out_urb_handler(struct urb *usb_urb)
+{
+	struct pcm_urb *out_urb = usb_urb->context;
+	struct pcm_runtime *rt = out_urb->chip->pcm;
+	struct pcm_substream *sub;
+	unsigned int periods = 0;
+	unsigned long flags;
+	const char *reason;
+	int state = hiface_pcm_state(rt);
+	bool active;
+	int ret;
+
+	if (hiface_pcm_panicked(rt) || state == STREAM_STOPPING ||
+	    state == STREAM_RECOVERING)
+		return;
+
+	trace_hiface_urb_complete(hiface_pcm_card(rt), out_urb - rt->out_urbs,
+				  usb_urb->status, rt->playback.dma_off,
+				  rt->playback.period_off);
+
+	if (unlikely(usb_urb->status)) {
+		reason = "urb completed with error";
+		ret = usb_urb->status;
+		goto out_fail;
+	}
+
+	hiface_stats_completed(&rt->stats, ktime_get(), out_urb->submit_time,
+			       state == STREAM_RUNNING);
+
+	if (state == STREAM_STARTING) {
+		rt->stream_wait_cond = true;
+		wake_up(&rt->stream_wait_queue);
+	}
+
+	if (hiface_pcm_monitor(rt, out_urb))
+		snd_pcm_period_elapsed(rt->monitor.instance);
+
+	/*
+	 * now send our playback data (if a free out urb was found), active
+	 * is read under the lock: once a stop trigger returns, no urb takes
+	 * data from a ring that hw_free or close may take away
+	 */
+	sub = &rt->playback;
+	spin_lock_irqsave(&sub->lock, flags);
+	active = sub->active;
+	write_seqcount_begin(&sub->seq);
+	sub->played += out_urb->frames;
+	sub->in_flight -= out_urb->frames;
+	out_urb->frames = 0;
+	if (out_urb->ring_bytes)
+		periods = hiface_pcm_release(rt, sub, out_urb, active);
+	write_seqcount_end(&sub->seq);
+	if (unlikely(sub->sync_urb == out_urb))
+		hiface_pcm_sync_done(rt, sub, ktime_get());
+
+	/* the switch settings are published under the lock */
+	if (hiface_pcm_state(rt) == STREAM_SWITCHING) {
+		if (++rt->parked == rt->n_urbs)
+			hiface_pcm_switch_parked(rt);
+		spin_unlock_irqrestore(&sub->lock, flags);
+
+		if (periods)
+			hiface_pcm_period_elapsed(rt, sub, periods);
+		return;
+	}
+
+	if (active)
+		periods += hiface_pcm_playback(sub, out_urb);
+	else
+		hiface_pcm_urb_use_silence(rt, out_urb);
+	spin_unlock_irqrestore(&sub->lock, flags);
+
+	if (periods)
+		hiface_pcm_period_elapsed(rt, sub, periods);
+
+	ret = hiface_pcm_submit_urb(rt, out_urb);
+	if (ret < 0) {
+		reason = "urb resubmit failed";
+		goto out_fail;
+	}
+
+	return;
+
+out_fail:
+	if (ret == -ENOENT ||		/* urb killed */
+	    ret == -ECONNRESET)		/* urb unlinked */
+		return;
+	if (ret == -ENODEV ||		/* device removed */
+	    ret == -ESHUTDOWN) {	/* device disabled */
+		hiface_pcm_set_panic(rt, reason, ret);
+		return;
+	}
+	hiface_pcm_recover(rt, ret);
+}
+
+static int hiface_pcm_open(struct snd_pcm_substream *alsa_sub)
+{
+	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
+	struct pcm_substream *sub = NULL;
+	struct snd_pcm_runtime *alsa_rt = alsa_sub->runtime;
+	int ret;
+
+	if (hiface_pcm_panicked(rt))
+		return -EPIPE;
+
+	ret = hiface_pcm_autoresume(rt);
+	if (ret < 0)
+		return ret;
+
+	mutex_lock(&rt->stream_mutex);
+	alsa_rt->hw = pcm_hw;
+
+	if (alsa_sub->stream == SNDRV_PCM_STREAM_PLAYBACK)
 		sub = &rt->playback;
 
-	if (!sub) {
-		struct device *device = &rt->chip->dev->dev;
-		mutex_unlock(&rt->stream_mutex);
-		dev_err(device, "Invalid stream type\n");
+	if (!sub) {
+		dev_err(&rt->chip->dev->dev, "Invalid stream type\n");
+		ret = -EINVAL;
+		goto err;
+	}
+
+	if (rt->deep_buffer) {
+		alsa_rt->hw.buffer_bytes_max = PCM_DEEP_BUFFER_SIZE;
+		alsa_rt->hw.period_bytes_max = PCM_DEEP_BUFFER_SIZE / 2;
+	}
+
+	/* hw_params never allocates, the buffer is what hiface_pcm_init got */
+	alsa_rt->hw.buffer_bytes_max = min_t(size_t, alsa_rt->hw.buffer_bytes_max,
+					     alsa_sub->dma_buffer.bytes);
+	alsa_rt->hw.period_bytes_max = min(alsa_rt->hw.period_bytes_max,
+					   alsa_rt->hw.buffer_bytes_max);
+
+	/* urbs are whole bulk packets, see hiface_pcm_urb_geometry */
+	ret = snd_pcm_hw_constraint_minmax(alsa_rt,
+					   SNDRV_PCM_HW_PARAM_PERIOD_SIZE,
+					   PCM_MIN_PERIOD_FRAMES, UINT_MAX);
+	if (ret < 0)
+		goto err;
+
+	if (rt->extra_freq) {
+		alsa_rt->hw.rates |= SNDRV_PCM_RATE_KNOT;
+		alsa_rt->hw.rate_max = 384000;
+
+		/* explicit constraints needed as we added SNDRV_PCM_RATE_KNOT */
+		ret = snd_pcm_hw_constraint_list(alsa_sub->runtime, 0,
+						 SNDRV_PCM_HW_PARAM_RATE,
+						 &constraints_extra_rates);
+		if (ret < 0)
+			goto err;
+	}
+
+	if (rt->zero_copy) {
+		/*
+		 * Samples are swapped as they are written, which mmap would
+		 * bypass, and the position only moves in whole urbs.
+		 */
+		alsa_rt->hw.info &= ~(SNDRV_PCM_INFO_MMAP |
+				      SNDRV_PCM_INFO_MMAP_VALID);
+		alsa_rt->hw.info |= SNDRV_PCM_INFO_BATCH;
+		alsa_rt->hw.formats = SNDRV_PCM_FMTBIT_S32_LE;
+
+		/* split points of the ring must fall on bulk packets */
+		ret = snd_pcm_hw_constraint_step(alsa_rt, 0,
+						 SNDRV_PCM_HW_PARAM_BUFFER_BYTES,
+						 PCM_PACKET_ALIGN);
+		if (ret < 0)
+			goto err;
+
+		/*
+		 * room for the smallest urbs in flight in half of the ring,
+		 * see hiface_pcm_urb_geometry
+		 */
+		ret = snd_pcm_hw_constraint_minmax(alsa_rt,
+				SNDRV_PCM_HW_PARAM_BUFFER_BYTES,
+				2 * PCM_MIN_URBS * PCM_PACKET_ALIGN, UINT_MAX);
+		if (ret < 0)
+			goto err;
+	}
+
+	/* a stream kept alive is taken over, see hiface_pcm_keep_alive_work */
+	cancel_delayed_work(&rt->keep_alive_work);
+
+	sub->instance = alsa_sub;
+	sub->active = false;
+	mutex_unlock(&rt->stream_mutex);
+	return 0;
+
+err:
+	mutex_unlock(&rt->stream_mutex);
+	usb_autopm_put_interface(rt->chip->intf);
+	return ret;
+}
+
+static int hiface_pcm_close(struct snd_pcm_substream *alsa_sub)
+{
+	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
+	struct pcm_substream *sub = hiface_pcm_get_substream(alsa_sub);
+	unsigned long flags;
+
+	/* the device may be gone, but the interface is still ours */
+	if (hiface_pcm_panicked(rt)) {
+		usb_autopm_put_interface(rt->chip->intf);
+		return 0;
+	}
+
+	mutex_lock(&rt->stream_mutex);
+	if (sub) {
+		/*
+		 * Keep the urbs running on silence for a while, so that the
+		 * next open at the same rate does not wait for a new stream.
+		 */
+		if (keep_alive_ms && hiface_pcm_state(rt) == STREAM_RUNNING)
+			schedule_delayed_work(&rt->keep_alive_work,
+					      msecs_to_jiffies(keep_alive_ms));
+		else
+			hiface_pcm_stream_stop(rt);
+
+		/* deactivate substream */
+		spin_lock_irqsave(&sub->lock, flags);
+		sub->instance = NULL;
+		sub->active = false;
+		spin_unlock_irqrestore(&sub->lock, flags);
+
+	}
+	mutex_unlock(&rt->stream_mutex);
+
+	usb_autopm_put_interface(rt->chip->intf);
+	return 0;
+}
+
+static int hiface_pcm_hw_params(struct snd_pcm_substream *alsa_sub,
+				struct snd_pcm_hw_params *hw_params)
+{
+	struct pcm_substream *sub = hiface_pcm_get_substream(alsa_sub);
+
+	if (!sub)
+		return -ENODEV;
+
+	switch (params_format(hw_params)) {
+	case SNDRV_PCM_FORMAT_S16_LE:
+		sub->convert = hiface_convert_s16;
+		sub->convert_gain = hiface_convert_gain_s16;
+		break;
+	case SNDRV_PCM_FORMAT_S24_LE:
+		sub->convert = hiface_convert_s24;
+		sub->convert_gain = hiface_convert_gain_s24;
+		break;
+	case SNDRV_PCM_FORMAT_S24_3LE:
+		sub->convert = hiface_convert_s24_3;
+		sub->convert_gain = hiface_convert_gain_s24_3;
+		break;
+	case SNDRV_PCM_FORMAT_S32_LE:
+		sub->convert = hiface_convert_s32;
+		sub->convert_gain = hiface_convert_gain_s32;
+		break;
+	default:
+		return -EINVAL;
+	}
+	sub->sample_bytes =
+		snd_pcm_format_physical_width(params_format(hw_params)) / 8;
+
+	/* takes the preallocated buffer, buffer_bytes_max is its size */
+	return snd_pcm_lib_malloc_pages(alsa_sub,
+					params_buffer_bytes(hw_params));
+}
+
+static int hiface_pcm_hw_free(struct snd_pcm_substream *alsa_sub)
+{
+	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
+
+	/* no urb may still be sending from the buffer we free */
+	mutex_lock(&rt->stream_mutex);
+	if (!hiface_pcm_wait_ring_idle(rt))
+		hiface_pcm_stream_stop(rt);
+	mutex_unlock(&rt->stream_mutex);
+
+	return snd_pcm_lib_free_pages(alsa_sub);
+}
+
+static int hiface_pcm_prepare(struct snd_pcm_substream *alsa_sub)
+{
+	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
+	struct pcm_substream *sub = hiface_pcm_get_substream(alsa_sub);
+	struct snd_pcm_runtime *alsa_rt = alsa_sub->runtime;
+	unsigned int n_urbs, packet_size;
+	int ret;
+
+	if (hiface_pcm_panicked(rt))
+		return -EPIPE;
+	if (!sub)
+		return -ENODEV;
+
+	mutex_lock(&rt->stream_mutex);
+
+	if (!hiface_pcm_wait_ring_idle(rt) ||
+	    hiface_pcm_state(rt) == STREAM_RECOVERING)
+		hiface_pcm_stream_stop(rt);
+
+	spin_lock_irq(&sub->lock);
+	write_seqcount_begin(&sub->seq);
+	sub->dma_off = 0;
+	sub->period_off = 0;
+	sub->last_off = 0;
+	sub->played = 0;
+	sub->sync_pending = false;
+	sub->sync_urb = NULL;
+	write_seqcount_end(&sub->seq);
+	spin_unlock_irq(&sub->lock);
+
+	/* a running stream is switched over, restart it only if that fails */
+	hiface_pcm_urb_geometry(rt, alsa_rt, &n_urbs, &packet_size);
+	if (hiface_pcm_state(rt) == STREAM_RUNNING &&
+	    (alsa_rt->rate != rt->rate ||
+	     n_urbs != rt->n_urbs || packet_size != rt->packet_size)) {
+		ret = hiface_pcm_stream_switch(rt, alsa_rt->rate, n_urbs,
+					       packet_size);
+		if (ret) {
+			dev_warn(&rt->chip->dev->dev,
+				 "rate switch failed (%d), restarting stream\n",
+				 ret);
+			hiface_pcm_stream_stop(rt);
+		}
+	}
+
+	if (hiface_pcm_state(rt) == STREAM_DISABLED) {
+		hiface_pcm_set_geometry(rt, n_urbs, packet_size);
+
+		if (alsa_rt->rate != rt->rate) {
+			ret = hiface_pcm_set_rate(rt, alsa_rt->rate);
+			if (ret) {
+				mutex_unlock(&rt->stream_mutex);
+				return ret;
+			}
+		}
+		ret = hiface_pcm_stream_start(rt);
+		if (ret) {
+			mutex_unlock(&rt->stream_mutex);
+			return ret;
+		}
+	}
+	mutex_unlock(&rt->stream_mutex);
+	return 0;
+}
+
+static void hiface_pcm_free(struct snd_pcm *pcm);
+
+/* the lock waits for a completion handler filling an urb, see there */
+static void hiface_pcm_set_active(struct pcm_substream *sub, bool active)
+{
+	spin_lock(&sub->lock);
+	sub->active = active;
+	spin_unlock(&sub->lock);
+}
+
+/* a playback substream of this driver, the monitor capture is not */
+static bool hiface_pcm_sync_member(struct snd_pcm_substream *s)
+{
+	return s->pcm->private_free == hiface_pcm_free &&
+	       s->stream == SNDRV_PCM_STREAM_PLAYBACK;
+}
+
+/*
+ * Linked start, for several cards playing in sync: every hiface playback
+ * substream of the group gets the same target time, far enough ahead for
+ * the longest urb queue, and its completion handler sends silence up to
+ * that time, see hiface_pcm_sync_skip. The urbs all run already, nothing
+ * waits for the bus here. The other members are marked done so that alsa
+ * does not trigger them again.
+ *
+ * A group with a single hiface playback, linked to other cards or to our
+ * own monitor, has nothing to align with and starts at once.
+ *
+ * called with the streams of the group locked
+ */
+static int hiface_pcm_sync_start(struct snd_pcm_substream *alsa_sub)
+{
+	struct pcm_runtime *own = snd_pcm_substream_chip(alsa_sub);
+	struct snd_pcm_substream *s;
+	unsigned int members = 0;
+	s64 lead = 0;
+	ktime_t target;
+
+	/* nothing starts unless all of them can */
+	snd_pcm_group_for_each_entry(s, alsa_sub) {
+		struct pcm_runtime *rt = snd_pcm_substream_chip(s);
+
+		if (!hiface_pcm_sync_member(s))
+			continue;
+		if (hiface_pcm_panicked(rt))
+			return -EPIPE;
+		if (!rt->playback.instance)
+			return -ENODEV;
+		lead = max_t(s64, lead, rt->n_urbs * hiface_pcm_urb_ns(rt));
+		members++;
+	}
+
+	if (members < 2) {
+		hiface_pcm_set_active(&own->playback, true);
+		return 0;
+	}
+
+	target = ktime_add_ns(ktime_get(),
+			      lead + PCM_SYNC_MARGIN_US * NSEC_PER_USEC);
+
+	snd_pcm_group_for_each_entry(s, alsa_sub) {
+		struct pcm_runtime *rt = snd_pcm_substream_chip(s);
+		struct pcm_substream *sub = &rt->playback;
+
+		if (!hiface_pcm_sync_member(s))
+			continue;
+
+		spin_lock(&sub->lock);
+		sub->sync_target = target;
+		sub->sync_pending = true;
+		sub->sync_urb = NULL;
+		sub->active = true;
+		spin_unlock(&sub->lock);
+
+		if (s != alsa_sub)
+			snd_pcm_trigger_done(s, alsa_sub);
+	}
+	return 0;
+}
+
+static int hiface_pcm_trigger(struct snd_pcm_substream *alsa_sub, int cmd)
+{
+	struct pcm_substream *sub = hiface_pcm_get_substream(alsa_sub);
+	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
+
+	if (hiface_pcm_panicked(rt))
+		return -EPIPE;
+	if (!sub)
+		return -ENODEV;
+
+	trace_hiface_trigger(hiface_pcm_card(rt), cmd);
+
+	switch (cmd) {
+	case SNDRV_PCM_TRIGGER_START:
+		if (snd_pcm_stream_linked(alsa_sub))
+			return hiface_pcm_sync_start(alsa_sub);
+		hiface_pcm_set_active(sub, true);
+		return 0;
+
+	case SNDRV_PCM_TRIGGER_RESUME:
+		/* alsa waits for D0, the urbs run again, see hiface_pcm_resume */
+		if (hiface_pcm_state(rt) != STREAM_RUNNING)
+			return -EIO;
+		/* fall through */
+	case SNDRV_PCM_TRIGGER_PAUSE_RELEASE:
+		hiface_pcm_set_active(sub, true);
+		return 0;
+
+	case SNDRV_PCM_TRIGGER_STOP:
+	case SNDRV_PCM_TRIGGER_SUSPEND:
+	case SNDRV_PCM_TRIGGER_PAUSE_PUSH:
+		hiface_pcm_set_active(sub, false);
+		return 0;
+
+	default:
+		return -EINVAL;
+	}
+}
+
+/*
+ * The position within the data of the last completion, see
+ * hiface_position_interpolate.
+ *
+ * call in a read section of sub->seq
+ */
+static snd_pcm_uframes_t hiface_pcm_interpolate(struct pcm_substream *sub,
+						struct snd_pcm_runtime *alsa_rt,
+						ktime_t now)
+{
+	return hiface_position_interpolate(alsa_rt->buffer_size,
+			bytes_to_frames(alsa_rt, sub->last_off),
+			bytes_to_frames(alsa_rt, sub->dma_off),
+			ktime_to_ns(ktime_sub(now, sub->last_time)),
+			alsa_rt->rate);
+}
+
+/*
+ * Zero-copy: the oldest ring data still referenced by an urb, nothing
+ * before it is in use anymore.
+ *
+ * call in a read section of sub->seq
+ */
+static snd_pcm_uframes_t hiface_pcm_ring_head(struct pcm_substream *sub,
+					      struct snd_pcm_runtime *alsa_rt)
+{
+	snd_pcm_uframes_t cur = bytes_to_frames(alsa_rt, sub->dma_off);
+	snd_pcm_uframes_t queued = bytes_to_frames(alsa_rt, sub->queued);
+
+	if (cur >= queued)
+		return cur - queued;
+	return cur + alsa_rt->buffer_size - queued;
+}
+
+/*
+ * Frames behind the position that the device has not played yet: what the
+ * urbs in flight carry, less the last fill that the interpolation is still
+ * reporting. Urbs with silence or a partial packet count for what they
+ * carry only. In zero-copy mode the position stays at the oldest data in
+ * flight and alsa already counts it.
+ *
+ * call in a read section of sub->seq
+ */
+static snd_pcm_sframes_t hiface_pcm_delay(struct pcm_runtime *rt,
+					  struct pcm_substream *sub,
+					  struct snd_pcm_runtime *alsa_rt)
+{
+	if (rt->zero_copy)
+		return 0;
+
+	return hiface_position_delay(alsa_rt->buffer_size,
+				     bytes_to_frames(alsa_rt, sub->last_off),
+				     bytes_to_frames(alsa_rt, sub->dma_off),
+				     sub->in_flight);
+}
+
+static snd_pcm_uframes_t hiface_pcm_pointer(struct snd_pcm_substream *alsa_sub)
+{
+	struct pcm_substream *sub = hiface_pcm_get_substream(alsa_sub);
+	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
+	snd_pcm_uframes_t pos;
+	snd_pcm_sframes_t delay;
+	ktime_t now;
+	unsigned int seq;
+
+	if (hiface_pcm_panicked(rt) || !sub)
+		return SNDRV_PCM_POS_XRUN;
+
+	now = ktime_get();
+	do {
+		seq = read_seqcount_begin(&sub->seq);
+		if (rt->zero_copy)
+			pos = hiface_pcm_ring_head(sub, alsa_sub->runtime);
+		else
+			pos = hiface_pcm_interpolate(sub, alsa_sub->runtime,
+						     now);
+		delay = hiface_pcm_delay(rt, sub, alsa_sub->runtime);
+	} while (read_seqcount_retry(&sub->seq, seq));
+
+	alsa_sub->runtime->delay = delay;
+	trace_hiface_pointer(hiface_pcm_card(rt), pos);
+	return pos;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+/*
+ * Link timestamps: the frames the device took up to the last completion,
+ * at the time of that completion. Other types fall back to the alsa
+ * default, from the position.
+ */
+static int hiface_pcm_get_time_info(struct snd_pcm_substream *alsa_sub,
+			struct timespec *system_ts, struct timespec *audio_ts,
+			struct snd_pcm_audio_tstamp_config *config,
+			struct snd_pcm_audio_tstamp_report *report)
+{
+	struct pcm_substream *sub = hiface_pcm_get_substream(alsa_sub);
+	struct snd_pcm_runtime *alsa_rt = alsa_sub->runtime;
+	ktime_t last_time, now;
+	unsigned int seq;
+	u64 played;
+
+	if (!sub ||
+	    config->type_requested != SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK) {
+		report->actual_type = SNDRV_PCM_AUDIO_TSTAMP_TYPE_DEFAULT;
+		return 0;
+	}
+
+	do {
+		seq = read_seqcount_begin(&sub->seq);
+		played = sub->played;
+		last_time = sub->last_time;
+	} while (read_seqcount_retry(&sub->seq, seq));
+
+	/* the completion time, on the clock the application asked for */
+	now = ktime_get();
+	snd_pcm_gettime(alsa_rt, system_ts);
+	*system_ts = ktime_to_timespec(ktime_sub(timespec_to_ktime(*system_ts),
+						 ktime_sub(now, last_time)));
+	*audio_ts = ns_to_timespec(div_u64(played * NSEC_PER_SEC,
+					   alsa_rt->rate));
+
+	report->actual_type = SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK;
+	report->accuracy_report = 1;
+	report->accuracy = 125000; /* a high-speed microframe, in ns */
+	return 0;
+}
+#endif
+
+/*
+ * Zero-copy: samples are put in device order as they are written, so that
+ * urbs can be sent straight from the ring buffer. The volume is applied
+ * here too, a change is heard once the ring written before it is played.
+ */
+static void hiface_pcm_swap_in(struct pcm_runtime *rt, u8 *dest,
+			       const u8 *src, unsigned int bytes)
+{
+	struct hiface_gain gain;
+	bool bypass;
+
+	spin_lock_irq(&rt->playback.lock);
+	gain = rt->gain;
+	bypass = rt->gain_bypass;
+	spin_unlock_irq(&rt->playback.lock);
+
+	if (bypass) {
+		hiface_memcpy_swahw32(dest, src, bytes);
+		return;
+	}
+
+	hiface_convert_gain_s32(dest, src, bytes / 4, &gain);
+
+	spin_lock_irq(&rt->playback.lock);
+	rt->gain.seed = gain.seed;
+	spin_unlock_irq(&rt->playback.lock);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+static int hiface_pcm_copy_user(struct snd_pcm_substream *alsa_sub,
+				int channel, unsigned long pos,
+				void __user *buf, unsigned long bytes)
+{
+	u8 *dest = alsa_sub->runtime->dma_area + pos;
+
+	if (copy_from_user(dest, buf, bytes))
+		return -EFAULT;
+
+	hiface_pcm_swap_in(snd_pcm_substream_chip(alsa_sub), dest, dest,
+			   bytes);
+	return 0;
+}
+
+static int hiface_pcm_copy_kernel(struct snd_pcm_substream *alsa_sub,
+				  int channel, unsigned long pos,
+				  void *buf, unsigned long bytes)
+{
+	hiface_pcm_swap_in(snd_pcm_substream_chip(alsa_sub),
+			   alsa_sub->runtime->dma_area + pos, buf, bytes);
+	return 0;
+}
+#else
+static int hiface_pcm_copy(struct snd_pcm_substream *alsa_sub, int channel,
+			   snd_pcm_uframes_t pos, void __user *buf,
+			   snd_pcm_uframes_t count)
+{
+	struct snd_pcm_runtime *alsa_rt = alsa_sub->runtime;
+	u8 *dest = alsa_rt->dma_area + frames_to_bytes(alsa_rt, pos);
+	unsigned int bytes = frames_to_bytes(alsa_rt, count);
+
+	if (copy_from_user(dest, buf, bytes))
+		return -EFAULT;
+
+	hiface_pcm_swap_in(snd_pcm_substream_chip(alsa_sub), dest, dest,
+			   bytes);
+	return 0;
+}
+#endif
+
+static int hiface_pcm_urb_quantum_info(struct snd_kcontrol *kcontrol,
+				       struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = 1;
+	uinfo->value.integer.min = 0; /* fixed size urbs */
+	uinfo->value.integer.max = PCM_MAX_QUANTUM_US;
+	return 0;
+}
+
+static int hiface_pcm_urb_quantum_get(struct snd_kcontrol *kcontrol,
+				      struct snd_ctl_elem_value *ucontrol)
+{
+	struct pcm_runtime *rt = snd_kcontrol_chip(kcontrol);
+
+	ucontrol->value.integer.value[0] = rt->urb_quantum_us;
+	return 0;
+}
+
+static int hiface_pcm_urb_quantum_put(struct snd_kcontrol *kcontrol,
+				      struct snd_ctl_elem_value *ucontrol)
+{
+	struct pcm_runtime *rt = snd_kcontrol_chip(kcontrol);
+	long val = ucontrol->value.integer.value[0];
+	int changed = 0;
+
+	if (val < 0 || val > PCM_MAX_QUANTUM_US ||
+	    (val && val < PCM_MIN_QUANTUM_US))
+		return -EINVAL;
+
+	mutex_lock(&rt->stream_mutex);
+	if (rt->urb_quantum_us != val) {
+		rt->urb_quantum_us = val;
+		changed = 1;
+	}
+	mutex_unlock(&rt->stream_mutex);
+	return changed;
+}
+
+static int hiface_pcm_urb_count_info(struct snd_kcontrol *kcontrol,
+				     struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = 1;
+	uinfo->value.integer.min = PCM_MIN_URBS;
+	uinfo->value.integer.max = PCM_MAX_URBS;
+	return 0;
+}
+
+static int hiface_pcm_urb_count_get(struct snd_kcontrol *kcontrol,
+				    struct snd_ctl_elem_value *ucontrol)
+{
+	struct pcm_runtime *rt = snd_kcontrol_chip(kcontrol);
+
+	ucontrol->value.integer.value[0] = rt->urb_count;
+	return 0;
+}
+
+static int hiface_pcm_urb_count_put(struct snd_kcontrol *kcontrol,
+				    struct snd_ctl_elem_value *ucontrol)
+{
+	struct pcm_runtime *rt = snd_kcontrol_chip(kcontrol);
+	long val = ucontrol->value.integer.value[0];
+	int changed = 0;
+
+	if (val < PCM_MIN_URBS || val > PCM_MAX_URBS)
 		return -EINVAL;
+
+	mutex_lock(&rt->stream_mutex);
+	if (rt->urb_count != val) {
+		rt->urb_count = val;
+		changed = 1;
 	}
+	mutex_unlock(&rt->stream_mutex);
+	return changed;
+}
 
-	if (rt->extra_freq) {
-		alsa_rt->hw.rates |= SNDRV_PCM_RATE_KNOT;
-		alsa_rt->hw.rate_max = 384000;
+/* call with playback.lock held */
+static void hiface_pcm_update_gain(struct pcm_runtime *rt)
+{
+	rt->gain.gain[0] = rt->mute ? 0 : rt->volume[0];
+	rt->gain.gain[1] = rt->mute ? 0 : rt->volume[1];
+	rt->gain_bypass = rt->gain.gain[0] == HIFACE_GAIN_UNITY &&
+			  rt->gain.gain[1] == HIFACE_GAIN_UNITY;
+}
 
-		/* explicit constraints needed as we added SNDRV_PCM_RATE_KNOT */
-		ret = snd_pcm_hw_constraint_list(alsa_sub->runtime, 0,
-						 SNDRV_PCM_HW_PARAM_RATE,
-						 &constraints_extra_rates);
-		if (ret < 0) {
-			mutex_unlock(&rt->stream_mutex);
-			return ret;
-		}
-	}
+static const DECLARE_TLV_DB_LINEAR(hiface_pcm_volume_tlv, TLV_DB_GAIN_MUTE, 0);
 
-	sub->instance = alsa_sub;
-	sub->active = false;
-	mutex_unlock(&rt->stream_mutex);
+static int hiface_pcm_volume_info(struct snd_kcontrol *kcontrol,
+				  struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = 2;
+	uinfo->value.integer.min = 0;
+	uinfo->value.integer.max = HIFACE_GAIN_UNITY;
 	return 0;
 }
 
-static int hiface_pcm_close(struct snd_pcm_substream *alsa_sub)
+static int hiface_pcm_volume_get(struct snd_kcontrol *kcontrol,
+				 struct snd_ctl_elem_value *ucontrol)
 {
-	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
-	struct pcm_substream *sub = hiface_pcm_get_substream(alsa_sub);
-	unsigned long flags;
+	struct pcm_runtime *rt = snd_kcontrol_chip(kcontrol);
 
-	if (rt->panic)
-		return 0;
+	spin_lock_irq(&rt->playback.lock);
+	ucontrol->value.integer.value[0] = rt->volume[0];
+	ucontrol->value.integer.value[1] = rt->volume[1];
+	spin_unlock_irq(&rt->playback.lock);
+	return 0;
+}
 
-	mutex_lock(&rt->stream_mutex);
-	if (sub) {
-		hiface_pcm_stream_stop(rt);
+static int hiface_pcm_volume_put(struct snd_kcontrol *kcontrol,
+				 struct snd_ctl_elem_value *ucontrol)
+{
+	struct pcm_runtime *rt = snd_kcontrol_chip(kcontrol);
+	long left = ucontrol->value.integer.value[0];
+	long right = ucontrol->value.integer.value[1];
+	int changed;
 
-		/* deactivate substream */
-		spin_lock_irqsave(&sub->lock, flags);
-		sub->instance = NULL;
-		sub->active = false;
-		spin_unlock_irqrestore(&sub->lock, flags);
+	if (left < 0 || left > HIFACE_GAIN_UNITY ||
+	    right < 0 || right > HIFACE_GAIN_UNITY)
+		return -EINVAL;
 
-	}
-	mutex_unlock(&rt->stream_mutex);
+	spin_lock_irq(&rt->playback.lock);
+	changed = rt->volume[0] != left || rt->volume[1] != right;
+	rt->volume[0] = left;
+	rt->volume[1] = right;
+	hiface_pcm_update_gain(rt);
+	spin_unlock_irq(&rt->playback.lock);
+	return changed;
+}
+
+static int hiface_pcm_switch_get(struct snd_kcontrol *kcontrol,
+				 struct snd_ctl_elem_value *ucontrol)
+{
+	struct pcm_runtime *rt = snd_kcontrol_chip(kcontrol);
+
+	ucontrol->value.integer.value[0] = !READ_ONCE(rt->mute);
 	return 0;
 }
 
-static int hiface_pcm_hw_params(struct snd_pcm_substream *alsa_sub,
-				struct snd_pcm_hw_params *hw_params)
+static int hiface_pcm_switch_put(struct snd_kcontrol *kcontrol,
+				 struct snd_ctl_elem_value *ucontrol)
 {
-	return snd_pcm_lib_alloc_vmalloc_buffer(alsa_sub,
-						params_buffer_bytes(hw_params));
+	struct pcm_runtime *rt = snd_kcontrol_chip(kcontrol);
+	bool mute = !ucontrol->value.integer.value[0];
+	int changed;
+
+	spin_lock_irq(&rt->playback.lock);
+	changed = rt->mute != mute;
+	rt->mute = mute;
+	hiface_pcm_update_gain(rt);
+	spin_unlock_irq(&rt->playback.lock);
+	return changed;
 }
 
-static int hiface_pcm_hw_free(struct snd_pcm_substream *alsa_sub)
+static int hiface_pcm_dither_get(struct snd_kcontrol *kcontrol,
+				 struct snd_ctl_elem_value *ucontrol)
 {
-	return snd_pcm_lib_free_vmalloc_buffer(alsa_sub);
+	struct pcm_runtime *rt = snd_kcontrol_chip(kcontrol);
+
+	ucontrol->value.integer.value[0] = READ_ONCE(rt->gain.dither);
+	return 0;
 }
 
-static int hiface_pcm_prepare(struct snd_pcm_substream *alsa_sub)
+static int hiface_pcm_dither_put(struct snd_kcontrol *kcontrol,
+				 struct snd_ctl_elem_value *ucontrol)
+{
+	struct pcm_runtime *rt = snd_kcontrol_chip(kcontrol);
+	bool dither = ucontrol->value.integer.value[0];
+	int changed;
+
+	spin_lock_irq(&rt->playback.lock);
+	changed = rt->gain.dither != dither;
+	rt->gain.dither = dither;
+	spin_unlock_irq(&rt->playback.lock);
+	return changed;
+}
+
+/*
+ * URB tunables, they take effect on the next prepare of the stream, and
+ * the software volume, applied from the next urb on.
+ */
+static const struct snd_kcontrol_new hiface_pcm_controls[] = {
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_PCM,
+		.name = "URB Quantum us",
+		.access = SNDRV_CTL_ELEM_ACCESS_READWRITE,
+		.info = hiface_pcm_urb_quantum_info,
+		.get = hiface_pcm_urb_quantum_get,
+		.put = hiface_pcm_urb_quantum_put,
+	},
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_PCM,
+		.name = "URB Count",
+		.access = SNDRV_CTL_ELEM_ACCESS_READWRITE,
+		.info = hiface_pcm_urb_count_info,
+		.get = hiface_pcm_urb_count_get,
+		.put = hiface_pcm_urb_count_put,
+	},
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name = "PCM Playback Volume",
+		.access = SNDRV_CTL_ELEM_ACCESS_READWRITE |
+			  SNDRV_CTL_ELEM_ACCESS_TLV_READ,
+		.info = hiface_pcm_volume_info,
+		.get = hiface_pcm_volume_get,
+		.put = hiface_pcm_volume_put,
+		.tlv.p = hiface_pcm_volume_tlv,
+	},
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name = "PCM Playback Switch",
+		.access = SNDRV_CTL_ELEM_ACCESS_READWRITE,
+		.info = snd_ctl_boolean_mono_info,
+		.get = hiface_pcm_switch_get,
+		.put = hiface_pcm_switch_put,
+	},
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name = "Dither Playback Switch",
+		.access = SNDRV_CTL_ELEM_ACCESS_READWRITE,
+		.info = snd_ctl_boolean_mono_info,
+		.get = hiface_pcm_dither_get,
+		.put = hiface_pcm_dither_put,
+	},
+};
+
+static int hiface_pcm_monitor_open(struct snd_pcm_substream *alsa_sub)
 {
 	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
-	struct pcm_substream *sub = hiface_pcm_get_substream(alsa_sub);
 	struct snd_pcm_runtime *alsa_rt = alsa_sub->runtime;
+	struct pcm_substream *sub = &rt->monitor;
 	int ret;
 
-	if (rt->panic)
+	if (hiface_pcm_panicked(rt))
 		return -EPIPE;
-	if (!sub)
-		return -ENODEV;
-
-	mutex_lock(&rt->stream_mutex);
-
-	sub->dma_off = 0;
-	sub->period_off = 0;
 
-	if (rt->stream_state == STREAM_DISABLED) {
+	alsa_rt->hw = pcm_monitor_hw;
+	alsa_rt->hw.buffer_bytes_max = min_t(size_t, alsa_rt->hw.buffer_bytes_max,
+					     alsa_sub->dma_buffer.bytes);
+	alsa_rt->hw.period_bytes_max = alsa_rt->hw.buffer_bytes_max;
 
-		ret = hiface_pcm_set_rate(rt, alsa_rt->rate);
-		if (ret) {
-			mutex_unlock(&rt->stream_mutex);
+	if (rt->extra_freq) {
+		alsa_rt->hw.rates |= SNDRV_PCM_RATE_KNOT;
+		alsa_rt->hw.rate_max = 384000;
+		ret = snd_pcm_hw_constraint_list(alsa_rt, 0,
+						 SNDRV_PCM_HW_PARAM_RATE,
+						 &constraints_extra_rates);
+		if (ret < 0)
 			return ret;
-		}
-		ret = hiface_pcm_stream_start(rt);
-		if (ret) {
+	}
+
+	/* the data comes at the rate of the stream, if there is one */
+	mutex_lock(&rt->stream_mutex);
+	if (rt->rate && hiface_pcm_state(rt) != STREAM_DISABLED) {
+		ret = snd_pcm_hw_constraint_minmax(alsa_rt,
+						   SNDRV_PCM_HW_PARAM_RATE,
+						   rt->rate, rt->rate);
+		if (ret < 0) {
 			mutex_unlock(&rt->stream_mutex);
 			return ret;
 		}
 	}
 	mutex_unlock(&rt->stream_mutex);
+
+	sub->instance = alsa_sub;
+	sub->active = false;
 	return 0;
 }
 
-static int hiface_pcm_trigger(struct snd_pcm_substream *alsa_sub, int cmd)
+static int hiface_pcm_monitor_close(struct snd_pcm_substream *alsa_sub)
+{
+	return 0;
+}
+
+static int hiface_pcm_monitor_hw_params(struct snd_pcm_substream *alsa_sub,
+					struct snd_pcm_hw_params *hw_params)
+{
+	return snd_pcm_lib_malloc_pages(alsa_sub,
+					params_buffer_bytes(hw_params));
+}
+
+static int hiface_pcm_monitor_hw_free(struct snd_pcm_substream *alsa_sub)
+{
+	return snd_pcm_lib_free_pages(alsa_sub);
+}
+
+static int hiface_pcm_monitor_prepare(struct snd_pcm_substream *alsa_sub)
 {
-	struct pcm_substream *sub = hiface_pcm_get_substream(alsa_sub);
 	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
+	struct pcm_substream *sub = &rt->monitor;
 
-	if (rt->panic)
-		return -EPIPE;
-	if (!sub)
-		return -ENODEV;
+	spin_lock_irq(&sub->lock);
+	sub->dma_off = 0;
+	sub->period_off = 0;
+	spin_unlock_irq(&sub->lock);
+	return 0;
+}
+
+/* the lock makes sure that no urb copies into the ring after stop */
+static int hiface_pcm_monitor_trigger(struct snd_pcm_substream *alsa_sub,
+				      int cmd)
+{
+	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
+	struct pcm_substream *sub = &rt->monitor;
+	bool active;
 
 	switch (cmd) {
 	case SNDRV_PCM_TRIGGER_START:
-	case SNDRV_PCM_TRIGGER_PAUSE_RELEASE:
-		spin_lock_irq(&sub->lock);
-		sub->active = true;
-		spin_unlock_irq(&sub->lock);
-		return 0;
-
+		active = true;
+		break;
 	case SNDRV_PCM_TRIGGER_STOP:
-	case SNDRV_PCM_TRIGGER_PAUSE_PUSH:
-		spin_lock_irq(&sub->lock);
-		sub->active = false;
-		spin_unlock_irq(&sub->lock);
-		return 0;
-
+	case SNDRV_PCM_TRIGGER_SUSPEND:
+		active = false;
+		break;
 	default:
 		return -EINVAL;
 	}
+
+	spin_lock(&sub->lock);
+	sub->active = active;
+	spin_unlock(&sub->lock);
+	return 0;
 }
 
-static snd_pcm_uframes_t hiface_pcm_pointer(struct snd_pcm_substream *alsa_sub)
+static snd_pcm_uframes_t
+hiface_pcm_monitor_pointer(struct snd_pcm_substream *alsa_sub)
 {
-	struct pcm_substream *sub = hiface_pcm_get_substream(alsa_sub);
 	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
-	unsigned long flags;
-	snd_pcm_uframes_t dma_offset;
 
-	if (rt->panic || !sub)
-		return SNDRV_PCM_STATE_XRUN;
+	if (hiface_pcm_panicked(rt))
+		return SNDRV_PCM_POS_XRUN;
 
-	spin_lock_irqsave(&sub->lock, flags);
-	dma_offset = sub->dma_off;
-	spin_unlock_irqrestore(&sub->lock, flags);
-	return bytes_to_frames(alsa_sub->runtime, dma_offset);
+	return bytes_to_frames(alsa_sub->runtime,
+			       READ_ONCE(rt->monitor.dma_off));
 }
 
+static struct snd_pcm_ops pcm_monitor_ops = {
+	.open = hiface_pcm_monitor_open,
+	.close = hiface_pcm_monitor_close,
+	.ioctl = snd_pcm_lib_ioctl,
+	.hw_params = hiface_pcm_monitor_hw_params,
+	.hw_free = hiface_pcm_monitor_hw_free,
+	.prepare = hiface_pcm_monitor_prepare,
+	.trigger = hiface_pcm_monitor_trigger,
+	.pointer = hiface_pcm_monitor_pointer,
+};
+
 static struct snd_pcm_ops pcm_ops = {
 	.open = hiface_pcm_open,
 	.close = hiface_pcm_close,
@@ -520,28 +2168,146 @@ static struct snd_pcm_ops pcm_ops = {
 	.prepare = hiface_pcm_prepare,
 	.trigger = hiface_pcm_trigger,
 	.pointer = hiface_pcm_pointer,
-	.page = snd_pcm_lib_get_vmalloc_page,
-	.mmap = snd_pcm_lib_mmap_vmalloc,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+	.get_time_info = hiface_pcm_get_time_info,
+#endif
+};
+
+static struct snd_pcm_ops pcm_zero_copy_ops = {
+	.open = hiface_pcm_open,
+	.close = hiface_pcm_close,
+	.ioctl = snd_pcm_lib_ioctl,
+	.hw_params = hiface_pcm_hw_params,
+	.hw_free = hiface_pcm_hw_free,
+	.prepare = hiface_pcm_prepare,
+	.trigger = hiface_pcm_trigger,
+	.pointer = hiface_pcm_pointer,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+	.get_time_info = hiface_pcm_get_time_info,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+	.copy_user = hiface_pcm_copy_user,
+	.copy_kernel = hiface_pcm_copy_kernel,
+#else
+	.copy = hiface_pcm_copy,
+#endif
 };
 
-static int hiface_pcm_init_urb(struct pcm_urb *urb,
-			       struct hiface_chip *chip,
-			       unsigned int ep,
-			       void (*handler)(struct urb *))
+static void hiface_pcm_init_urb(struct pcm_urb *urb,
+				struct hiface_chip *chip,
+				unsigned int ep,
+				void (*handler)(struct urb *),
+				u8 *buffer, dma_addr_t dma)
 {
 	urb->chip = chip;
 	usb_init_urb(&urb->instance);
 
-	urb->buffer = kzalloc(PCM_PACKET_SIZE, GFP_KERNEL);
-	if (!urb->buffer)
-		return -ENOMEM;
+	urb->buffer = buffer;
+	urb->dma = dma;
 
 	usb_fill_bulk_urb(&urb->instance, chip->dev,
 			  usb_sndbulkpipe(chip->dev, ep), (void *)urb->buffer,
 			  PCM_PACKET_SIZE, handler, urb);
+	urb->instance.transfer_dma = dma;
+	urb->instance.transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
 	init_usb_anchor(&urb->submitted);
+}
 
-	return 0;
+static void hiface_pcm_keep_alive_work(struct work_struct *work)
+{
+	struct pcm_runtime *rt = container_of(to_delayed_work(work),
+					      struct pcm_runtime,
+					      keep_alive_work);
+
+	mutex_lock(&rt->stream_mutex);
+	if (!rt->playback.instance)
+		hiface_pcm_stream_stop(rt);
+	mutex_unlock(&rt->stream_mutex);
+}
+
+/* tell the application that data was lost, the stream has to be prepared */
+static void hiface_pcm_report_xrun(struct snd_pcm_substream *alsa_sub)
+{
+	unsigned long flags;
+
+	snd_pcm_stream_lock_irqsave(alsa_sub, flags);
+	if (snd_pcm_running(alsa_sub))
+		snd_pcm_stop(alsa_sub, SNDRV_PCM_STATE_XRUN);
+	snd_pcm_stream_unlock_irqrestore(alsa_sub, flags);
+}
+
+static void hiface_pcm_recover_work(struct work_struct *work)
+{
+	struct pcm_runtime *rt = container_of(to_delayed_work(work),
+					      struct pcm_runtime,
+					      recover_work);
+	struct usb_device *device = rt->chip->dev;
+	struct snd_pcm_substream *alsa_sub;
+	const char *reason;
+	unsigned int rate;
+	int ret;
+
+	mutex_lock(&rt->stream_mutex);
+
+	/* the stream may have been stopped or prepared again meanwhile */
+	if (hiface_pcm_panicked(rt) || hiface_pcm_state(rt) != STREAM_RECOVERING)
+		goto out;
+
+	alsa_sub = rt->playback.instance;
+	if (rt->recover_report && alsa_sub)
+		hiface_pcm_report_xrun(alsa_sub);
+	rt->recover_report = false;
+
+	rate = rt->rate;
+	if (!rate && alsa_sub)
+		rate = alsa_sub->runtime->rate;
+
+	hiface_pcm_stream_stop(rt);
+	if (!rate) {
+		/* nothing to play, the next prepare starts a new stream */
+		goto out;
+	}
+
+	/* restarts that get the urbs going count too, the link may not hold */
+	if (rt->recover_attempts == PCM_RECOVER_ATTEMPTS) {
+		ret = rt->recover_err;
+		reason = "stream keeps failing";
+		goto fail;
+	}
+	rt->recover_attempts++;
+
+	if (rt->recover_err == -EPIPE)
+		usb_clear_halt(device, usb_sndbulkpipe(device, OUT_EP));
+
+	/* the device may have lost its setting along with the data */
+	ret = hiface_pcm_set_rate(rt, rate);
+	if (!ret) {
+		/* set before the stream runs and hiface_pcm_recover reads it */
+		rt->recover_done = ktime_get();
+		ret = hiface_pcm_stream_start(rt);
+	}
+	if (!ret) {
+		hiface_stats_recovered(&rt->stats, rt->recover_err,
+				       ktime_us_delta(ktime_get(),
+						      rt->recover_start));
+		goto out;
+	}
+
+	if (ret == -ENODEV || ret == -ESHUTDOWN ||
+	    rt->recover_attempts == PCM_RECOVER_ATTEMPTS) {
+		reason = "stream restart failed";
+		goto fail;
+	}
+
+	hiface_pcm_set_state(rt, STREAM_RECOVERING);
+	schedule_delayed_work(&rt->recover_work, hiface_pcm_recover_delay(rt));
+	goto out;
+
+fail:
+	dev_err(&device->dev, "cannot restart stream (%d)\n", ret);
+	hiface_pcm_set_panic(rt, reason, ret);
+out:
+	mutex_unlock(&rt->stream_mutex);
 }
 
 void hiface_pcm_abort(struct hiface_chip *chip)
@@ -549,7 +2315,10 @@ void hiface_pcm_abort(struct hiface_chip *chip)
 	struct pcm_runtime *rt = chip->pcm;
 
 	if (rt) {
-		rt->panic = true;
+		hiface_pcm_set_panic(rt, "device disconnected", -ENODEV);
+		cancel_delayed_work_sync(&rt->keep_alive_work);
+		cancel_delayed_work_sync(&rt->recover_work);
+		cancel_work_sync(&rt->resume_work);
 
 		mutex_lock(&rt->stream_mutex);
 		hiface_pcm_stream_stop(rt);
@@ -557,16 +2326,111 @@ void hiface_pcm_abort(struct hiface_chip *chip)
 	}
 }
 
-static void hiface_pcm_destroy(struct hiface_chip *chip)
+/*
+ * The urbs do not survive a system sleep: stop them and remember the rate
+ * of a stream with a substream open, hiface_pcm_resume restarts it and the
+ * substream goes on from where it was suspended.
+ *
+ * Autosuspend only happens with the stream stopped, this is not called then.
+ */
+void hiface_pcm_suspend(struct hiface_chip *chip)
 {
 	struct pcm_runtime *rt = chip->pcm;
-	int i;
+	struct snd_pcm_substream *alsa_sub;
+	bool pending;
+	int state;
+
+	if (!rt)
+		return;
 
-	for (i = 0; i < PCM_N_URBS; i++)
-		kfree(rt->out_urbs[i].buffer);
+	snd_pcm_suspend_all(rt->instance);
+	cancel_delayed_work_sync(&rt->keep_alive_work);
+	cancel_delayed_work_sync(&rt->recover_work);
+	/* a restart still pending from the last resume stays pending */
+	pending = cancel_work_sync(&rt->resume_work);
 
-	kfree(chip->pcm);
-	chip->pcm = NULL;
+	mutex_lock(&rt->stream_mutex);
+	alsa_sub = rt->playback.instance;
+	state = hiface_pcm_state(rt);
+
+	if (!pending) {
+		rt->resume_rate = 0;
+		if (alsa_sub &&
+		    (state == STREAM_RUNNING || state == STREAM_RECOVERING))
+			rt->resume_rate = rt->rate ? rt->rate :
+						     alsa_sub->runtime->rate;
+	}
+
+	hiface_pcm_stream_stop(rt);
+	rt->rate = 0; /* the device may not keep it */
+	mutex_unlock(&rt->stream_mutex);
+}
+
+static void hiface_pcm_resume_work(struct work_struct *work)
+{
+	struct pcm_runtime *rt = container_of(work, struct pcm_runtime,
+					      resume_work);
+	struct device *device = &rt->chip->dev->dev;
+	int ret;
+
+	mutex_lock(&rt->stream_mutex);
+	if (rt->resume_rate && !hiface_pcm_panicked(rt) &&
+	    hiface_pcm_state(rt) == STREAM_DISABLED) {
+		ret = hiface_pcm_set_rate(rt, rt->resume_rate);
+		if (!ret)
+			ret = hiface_pcm_stream_start(rt);
+
+		/* a failed resume trigger makes the application prepare */
+		if (ret)
+			dev_warn(device, "cannot restart stream on resume (%d)\n",
+				 ret);
+		else
+			dev_dbg(device, "stream restarted in %lld us\n",
+				(long long)ktime_us_delta(ktime_get(),
+							  rt->resume_start));
+	}
+	rt->resume_rate = 0;
+	mutex_unlock(&rt->stream_mutex);
+
+	snd_power_change_state(rt->chip->card, SNDRV_CTL_POWER_D0);
+}
+
+/*
+ * Also after a reset, the rate is sent again anyway. The restart waits
+ * for the first urb, up to a second, so it does not hold up the system
+ * resume: the card goes back to D0 once it is done, alsa keeps the
+ * applications waiting until then, their resume trigger included.
+ */
+void hiface_pcm_resume(struct hiface_chip *chip)
+{
+	struct pcm_runtime *rt = chip->pcm;
+
+	if (rt && rt->resume_rate) {
+		rt->resume_start = ktime_get();
+		schedule_work(&rt->resume_work);
+	} else {
+		snd_power_change_state(chip->card, SNDRV_CTL_POWER_D0);
+	}
+}
+
+/* also for a pcm that hiface_pcm_init gave up on, before chip->pcm was set */
+static void hiface_pcm_destroy(struct pcm_runtime *rt)
+{
+	struct hiface_chip *chip = rt->chip;
+
+	cancel_delayed_work_sync(&rt->keep_alive_work);
+	cancel_delayed_work_sync(&rt->recover_work);
+	cancel_work_sync(&rt->resume_work);
+	usb_free_coherent(chip->dev, PCM_COHERENT_SIZE,
+			  rt->out_buffer, rt->out_dma);
+	usb_put_intf(chip->intf);
+	usb_put_dev(chip->dev);
+
+	hiface_stats_free(&rt->stats);
+	kfree(rt->rate_setup);
+	if (chip->pcm == rt)
+		chip->pcm = NULL;
+	kfree(rt);
 }
 
 static void hiface_pcm_free(struct snd_pcm *pcm)
@@ -574,12 +2438,27 @@ static void hiface_pcm_free(struct snd_pcm *pcm)
 	struct pcm_runtime *rt = pcm->private_data;
 
 	if (rt)
-		hiface_pcm_destroy(rt->chip);
+		hiface_pcm_destroy(rt);
+}
+
+/*
+ * ALSA retries with smaller sizes if the allocation fails, and
+ * buffer_bytes_max follows, see hiface_pcm_open. Nothing tells when all of
+ * them failed but the empty buffer.
+ */
+static int hiface_pcm_preallocate(struct snd_pcm_substream *alsa_sub,
+				  size_t size)
+{
+	snd_pcm_lib_preallocate_pages(alsa_sub, SNDRV_DMA_TYPE_CONTINUOUS,
+			snd_dma_continuous_data(GFP_KERNEL | __GFP_NOWARN),
+			size, size);
+	return alsa_sub->dma_buffer.bytes ? 0 : -ENOMEM;
 }
 
 int hiface_pcm_init(struct hiface_chip *chip, u8 extra_freq)
 {
 	int i;
+	size_t prealloc;
 	int ret;
 	struct snd_pcm *pcm;
 	struct pcm_runtime *rt;
@@ -589,33 +2468,142 @@ int hiface_pcm_init(struct hiface_chip *chip, u8 extra_freq)
 		return -ENOMEM;
 
 	rt->chip = chip;
-	rt->stream_state = STREAM_DISABLED;
+	atomic_set(&rt->stream_state, STREAM_DISABLED);
 	if (extra_freq)
 		rt->extra_freq = 1;
 
+	if (urb_quantum_us)
+		rt->urb_quantum_us = clamp_t(unsigned int, urb_quantum_us,
+					     PCM_MIN_QUANTUM_US,
+					     PCM_MAX_QUANTUM_US);
+	rt->urb_count = clamp_t(unsigned int, urb_count,
+				PCM_MIN_URBS, PCM_MAX_URBS);
+	rt->deep_buffer = deep_buffer;
+
+	rt->volume[0] = HIFACE_GAIN_UNITY;
+	rt->volume[1] = HIFACE_GAIN_UNITY;
+	hiface_pcm_update_gain(rt);
+	rt->gain.seed = 1;
+
+	/* the host controller has to take the ring pages as a scatter list */
+	rt->zero_copy = zero_copy &&
+			chip->dev->bus->sg_tablesize >= PCM_MAX_SGS;
+	if (zero_copy && !rt->zero_copy)
+		dev_warn(&chip->dev->dev,
+			 "host controller lacks scatter-gather, zero-copy disabled\n");
+
+	/* the rate is sent with a control urb while streaming, see STREAM_SWITCHING */
+	rt->rate_setup = kzalloc(sizeof(*rt->rate_setup), GFP_KERNEL);
+	if (!rt->rate_setup) {
+		kfree(rt);
+		return -ENOMEM;
+	}
+	rt->rate_setup->bRequestType =
+		USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_OTHER;
+	rt->rate_setup->bRequest = HIFACE_SET_RATE_REQUEST;
+	usb_init_urb(&rt->rate_urb);
+
 	init_waitqueue_head(&rt->stream_wait_queue);
+	INIT_DELAYED_WORK(&rt->keep_alive_work, hiface_pcm_keep_alive_work);
+	INIT_DELAYED_WORK(&rt->recover_work, hiface_pcm_recover_work);
+	INIT_WORK(&rt->resume_work, hiface_pcm_resume_work);
 	mutex_init(&rt->stream_mutex);
 	spin_lock_init(&rt->playback.lock);
+	seqcount_init(&rt->playback.seq);
+	spin_lock_init(&rt->monitor.lock);
+	seqcount_init(&rt->monitor.seq);
+
+	/*
+	 * One coherent region for all the out urbs, so that submitting them
+	 * needs no streaming DMA mapping and no cache maintenance.
+	 */
+	rt->out_buffer = usb_alloc_coherent(chip->dev, PCM_COHERENT_SIZE,
+					    GFP_KERNEL, &rt->out_dma);
+	if (!rt->out_buffer) {
+		kfree(rt->rate_setup);
+		kfree(rt);
+		return -ENOMEM;
+	}
+
+	ret = hiface_stats_init(&rt->stats, chip->card->number);
+	if (ret < 0) {
+		usb_free_coherent(chip->dev, PCM_COHERENT_SIZE,
+				  rt->out_buffer, rt->out_dma);
+		kfree(rt->rate_setup);
+		kfree(rt);
+		return ret;
+	}
+	memset(rt->out_buffer + PCM_SILENCE_OFFSET, 0, PCM_MAX_PACKET_SIZE);
 
-	for (i = 0; i < PCM_N_URBS; i++)
+	for (i = 0; i < PCM_MAX_URBS; i++)
 		hiface_pcm_init_urb(&rt->out_urbs[i], chip, OUT_EP,
-				    hiface_pcm_out_urb_handler);
+				    hiface_pcm_out_urb_handler,
+				    rt->out_buffer, rt->out_dma);
+	hiface_pcm_set_geometry(rt, rt->urb_count, PCM_PACKET_SIZE);
 
-	ret = snd_pcm_new(chip->card, "USB-SPDIF Audio", 0, 1, 0, &pcm);
+	ret = snd_pcm_new(chip->card, "USB-SPDIF Audio", 0, 1, monitor ? 1 : 0,
+			  &pcm);
 	if (ret < 0) {
+		hiface_stats_free(&rt->stats);
+		usb_free_coherent(chip->dev, PCM_COHERENT_SIZE,
+				  rt->out_buffer, rt->out_dma);
+		kfree(rt->rate_setup);
 		kfree(rt);
 		dev_err(&chip->dev->dev, "Cannot create pcm instance\n");
 		return ret;
 	}
 
+	/* the coherent buffer is released with the pcm, maybe after disconnect */
+	usb_get_dev(chip->dev);
+	usb_get_intf(chip->intf);
+
+	/* from here on freeing the card frees rt, see hiface_pcm_destroy */
 	pcm->private_data = rt;
 	pcm->private_free = hiface_pcm_free;
+	rt->instance = pcm;
+	chip->pcm = rt;
 
 	strlcpy(pcm->name, "USB-SPDIF Audio", sizeof(pcm->name));
-	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_PLAYBACK, &pcm_ops);
+	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_PLAYBACK,
+			rt->zero_copy ? &pcm_zero_copy_ops : &pcm_ops);
+	if (monitor)
+		snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_CAPTURE,
+				&pcm_monitor_ops);
 
-	rt->instance = pcm;
+	/*
+	 * One physically contiguous buffer per substream, kept across
+	 * streams: hw_params only hands it out, and the usb core can map it
+	 * for the zero-copy urbs. The monitor never goes past
+	 * PCM_BUFFER_SIZE, see pcm_monitor_hw.
+	 */
+	prealloc = rt->deep_buffer ? PCM_DEEP_BUFFER_SIZE : PCM_BUFFER_SIZE;
+	if (prealloc_kb)
+		prealloc = clamp_t(size_t, (size_t)prealloc_kb * 1024,
+				   PCM_PACKET_SIZE, prealloc);
+	ret = hiface_pcm_preallocate(
+		pcm->streams[SNDRV_PCM_STREAM_PLAYBACK].substream, prealloc);
+	if (ret < 0) {
+		dev_err(&chip->dev->dev, "Cannot preallocate the pcm buffer\n");
+		return ret;
+	}
+	if (monitor) {
+		ret = hiface_pcm_preallocate(
+			pcm->streams[SNDRV_PCM_STREAM_CAPTURE].substream,
+			PCM_BUFFER_SIZE);
+		if (ret < 0) {
+			dev_err(&chip->dev->dev,
+				"Cannot preallocate the monitor buffer\n");
+			return ret;
+		}
+	}
 
-	chip->pcm = rt;
+	for (i = 0; i < ARRAY_SIZE(hiface_pcm_controls); i++) {
+		ret = snd_ctl_add(chip->card,
+				  snd_ctl_new1(&hiface_pcm_controls[i], rt));
+		if (ret < 0) {
+			dev_err(&chip->dev->dev, "Cannot add pcm controls\n");
+			return ret;
+		}
+	}
 	return 0;
 }
@@ -21,4 +21,6 @@ struct hiface_chip;
 
 int hiface_pcm_init(struct hiface_chip *chip, u8 extra_freq);
 void hiface_pcm_abort(struct hiface_chip *chip);
+void hiface_pcm_suspend(struct hiface_chip *chip);
+void hiface_pcm_resume(struct hiface_chip *chip);
 #endif /* HIFACE_PCM_H */
@@ -0,0 +1,194 @@
+/*
+ * Linux driver for M2Tech hiFace compatible devices
+ *
+ * Copyright 2012-2013 (C) M2TECH S.r.l and Amarula Solutions B.V.
+ *
+ * Authors:  Michael Trimarchi <michael@amarulasolutions.com>
+ *           Antonio Ospite <ao2@amarulasolutions.com>
+ *
+ * The driver is based on the work done in TerraTec DMX 6Fire USB
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <linux/debugfs.h>
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/module.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+
+#include "compat.h"
+#include "stats.h"
+
+/*
+ * Statistics of the out urbs, in <debugfs>/snd_usb_hiface/cardN/stats.
+ *
+ * A completion interval much longer than the urb duration with a normal
+ * latency points at the host controller, underruns with regular intervals
+ * point at the application not keeping the buffer filled.
+ */
+static struct dentry *hiface_stats_root;
+
+static void hiface_stats_sum(struct hiface_stats *stats,
+			     struct hiface_cpu_stats *sum)
+{
+	int cpu;
+	int i;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		struct hiface_cpu_stats *s = per_cpu_ptr(stats->cpu, cpu);
+
+		sum->completions += s->completions;
+		sum->underruns += s->underruns;
+		for (i = 0; i < HIFACE_STATS_BUCKETS; i++) {
+			sum->interval[i] += s->interval[i];
+			sum->latency[i] += s->latency[i];
+		}
+		for (i = 0; i < HIFACE_STATS_ERRNOS; i++)
+			sum->submit_errors[i] += s->submit_errors[i];
+	}
+}
+
+static void hiface_stats_show_histogram(struct seq_file *m, const char *name,
+					const u64 *buckets)
+{
+	int i;
+
+	seq_printf(m, "%s:\n", name);
+	for (i = 0; i < HIFACE_STATS_BUCKETS; i++) {
+		if (!buckets[i])
+			continue;
+		if (i == HIFACE_STATS_BUCKETS - 1)
+			seq_printf(m, "  >= %8u us: %llu\n", 1U << (i - 1),
+				   (unsigned long long)buckets[i]);
+		else
+			seq_printf(m, "  <  %8u us: %llu\n", 1U << i,
+				   (unsigned long long)buckets[i]);
+	}
+}
+
+static int hiface_stats_show(struct seq_file *m, void *v)
+{
+	struct hiface_stats *stats = m->private;
+	struct hiface_cpu_stats *sum;
+	int min_in_flight = READ_ONCE(stats->min_in_flight);
+	int i;
+
+	sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+	hiface_stats_sum(stats, sum);
+
+	seq_printf(m, "completions: %llu\n",
+		   (unsigned long long)sum->completions);
+	seq_printf(m, "underrun urbs: %llu\n",
+		   (unsigned long long)sum->underruns);
+	seq_printf(m, "urbs in flight: %d\n", atomic_read(&stats->in_flight));
+	if (min_in_flight != INT_MAX)
+		seq_printf(m, "min urbs in flight: %d\n", min_in_flight);
+
+	hiface_stats_show_histogram(m, "completion interval", sum->interval);
+	hiface_stats_show_histogram(m, "submit to completion", sum->latency);
+
+	seq_puts(m, "submit errors:\n");
+	for (i = 1; i < HIFACE_STATS_ERRNOS; i++)
+		if (sum->submit_errors[i])
+			seq_printf(m, "  -%d: %llu\n", i,
+				   (unsigned long long)sum->submit_errors[i]);
+	if (sum->submit_errors[0])
+		seq_printf(m, "  other: %llu\n",
+			   (unsigned long long)sum->submit_errors[0]);
+
+	if (stats->recoveries)
+		seq_printf(m, "recoveries: %u, last after %d in %lld us, max %lld us\n",
+			   stats->recoveries, stats->recover_errno,
+			   (long long)stats->last_recover_us,
+			   (long long)stats->max_recover_us);
+
+	if (stats->resumes)
+		seq_printf(m, "resumes: %u, last in %lld us, max %lld us\n",
+			   stats->resumes, (long long)stats->last_resume_us,
+			   (long long)stats->max_resume_us);
+
+	if (stats->sync_starts)
+		seq_printf(m, "linked starts: %u, last %lld us off, max %lld us\n",
+			   stats->sync_starts,
+			   (long long)stats->last_sync_error_us,
+			   (long long)stats->max_sync_error_us);
+
+	if (stats->panic_reason)
+		seq_printf(m, "last panic: %s (%d) at %lld ms\n",
+			   stats->panic_reason, stats->panic_errno,
+			   (long long)ktime_to_ms(stats->panic_time));
+
+	kfree(sum);
+	return 0;
+}
+
+static int hiface_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, hiface_stats_show, inode->i_private);
+}
+
+static const struct file_operations hiface_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = hiface_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* call before the first urb of a stream is submitted */
+void hiface_stats_stream_start(struct hiface_stats *stats)
+{
+	atomic_set(&stats->in_flight, 0);
+	stats->min_in_flight = INT_MAX;
+	stats->last_completion = ktime_set(0, 0);
+}
+
+int hiface_stats_init(struct hiface_stats *stats, int card_number)
+{
+	char name[16];
+
+	stats->cpu = alloc_percpu(struct hiface_cpu_stats);
+	if (!stats->cpu)
+		return -ENOMEM;
+	hiface_stats_stream_start(stats);
+
+	/* statistics are optional, the driver works without debugfs */
+	if (IS_ERR_OR_NULL(hiface_stats_root))
+		return 0;
+
+	snprintf(name, sizeof(name), "card%d", card_number);
+	stats->dir = debugfs_create_dir(name, hiface_stats_root);
+	if (IS_ERR_OR_NULL(stats->dir)) {
+		stats->dir = NULL;
+		return 0;
+	}
+	debugfs_create_file("stats", 0444, stats->dir, stats,
+			    &hiface_stats_fops);
+	return 0;
+}
+
+void hiface_stats_free(struct hiface_stats *stats)
+{
+	debugfs_remove_recursive(stats->dir);
+	stats->dir = NULL;
+	free_percpu(stats->cpu);
+	stats->cpu = NULL;
+}
+
+void hiface_stats_module_init(void)
+{
+	hiface_stats_root = debugfs_create_dir(KBUILD_MODNAME, NULL);
+}
+
+void hiface_stats_module_exit(void)
+{
+	debugfs_remove_recursive(hiface_stats_root);
+}
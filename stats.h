@@ -0,0 +1,166 @@
+/*
+ * Linux driver for M2Tech hiFace compatible devices
+ *
+ * Copyright 2012-2013 (C) M2TECH S.r.l and Amarula Solutions B.V.
+ *
+ * Authors:  Michael Trimarchi <michael@amarulasolutions.com>
+ *           Antonio Ospite <ao2@amarulasolutions.com>
+ *
+ * The driver is based on the work done in TerraTec DMX 6Fire USB
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef HIFACE_STATS_H
+#define HIFACE_STATS_H
+
+#include <linux/atomic.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+
+#define HIFACE_STATS_BUCKETS 16  /* log2 of microseconds, last one open */
+#define HIFACE_STATS_ERRNOS  128 /* submit errors above go to slot 0 */
+
+struct dentry;
+
+/* counters only ever touched by the local cpu, summed when read */
+struct hiface_cpu_stats {
+	u64 completions;
+	u64 interval[HIFACE_STATS_BUCKETS]; /* between completions */
+	u64 latency[HIFACE_STATS_BUCKETS];  /* from submit to completion */
+	u64 underruns;
+	u64 submit_errors[HIFACE_STATS_ERRNOS];
+};
+
+struct hiface_stats {
+	struct hiface_cpu_stats __percpu *cpu;
+	struct dentry *dir;
+
+	/* only written from the completion handler, which is serialized */
+	ktime_t last_completion;
+	atomic_t in_flight;
+	int min_in_flight;
+
+	/* streams restarted after an urb error, updated by the recovery work */
+	unsigned int recoveries;
+	int recover_errno;
+	s64 last_recover_us;
+	s64 max_recover_us;
+
+	/* runtime resumes on open, measured in hiface_pcm_autoresume */
+	unsigned int resumes;
+	s64 last_resume_us;
+	s64 max_resume_us;
+
+	/*
+	 * linked starts, see hiface_pcm_sync_start: when the first frame
+	 * played against the time common to the group, positive if late
+	 */
+	unsigned int sync_starts;
+	s64 last_sync_error_us;
+	s64 max_sync_error_us; /* in absolute value */
+
+	/* the last reason the driver gave up streaming */
+	const char *panic_reason;
+	int panic_errno;
+	ktime_t panic_time;
+};
+
+int hiface_stats_init(struct hiface_stats *stats, int card_number);
+void hiface_stats_free(struct hiface_stats *stats);
+void hiface_stats_stream_start(struct hiface_stats *stats);
+void hiface_stats_module_init(void);
+void hiface_stats_module_exit(void);
+
+static inline unsigned int hiface_stats_bucket(s64 us)
+{
+	if (us <= 0)
+		return 0;
+	return min_t(unsigned int, fls64(us), HIFACE_STATS_BUCKETS - 1);
+}
+
+static inline void hiface_stats_submitted(struct hiface_stats *stats)
+{
+	atomic_inc(&stats->in_flight);
+}
+
+static inline void hiface_stats_submit_error(struct hiface_stats *stats,
+					     int err)
+{
+	unsigned int slot = -err;
+
+	if (slot >= HIFACE_STATS_ERRNOS)
+		slot = 0;
+	this_cpu_inc(stats->cpu->submit_errors[slot]);
+}
+
+/* min_in_flight is only meaningful while the urbs are all cycling */
+static inline void hiface_stats_completed(struct hiface_stats *stats,
+					  ktime_t now, ktime_t submitted,
+					  bool steady)
+{
+	int in_flight = atomic_dec_return(&stats->in_flight);
+	unsigned int bucket;
+
+	this_cpu_inc(stats->cpu->completions);
+
+	bucket = hiface_stats_bucket(ktime_us_delta(now, submitted));
+	this_cpu_inc(stats->cpu->latency[bucket]);
+
+	if (ktime_to_ns(stats->last_completion)) {
+		bucket = hiface_stats_bucket(ktime_us_delta(now,
+						stats->last_completion));
+		this_cpu_inc(stats->cpu->interval[bucket]);
+	}
+	stats->last_completion = now;
+
+	if (steady && in_flight < stats->min_in_flight)
+		stats->min_in_flight = in_flight;
+}
+
+static inline void hiface_stats_underrun(struct hiface_stats *stats)
+{
+	this_cpu_inc(stats->cpu->underruns);
+}
+
+static inline void hiface_stats_recovered(struct hiface_stats *stats,
+					  int err, s64 us)
+{
+	stats->recoveries++;
+	stats->recover_errno = err;
+	stats->last_recover_us = us;
+	if (us > stats->max_recover_us)
+		stats->max_recover_us = us;
+}
+
+static inline void hiface_stats_resumed(struct hiface_stats *stats, s64 us)
+{
+	stats->resumes++;
+	stats->last_resume_us = us;
+	if (us > stats->max_resume_us)
+		stats->max_resume_us = us;
+}
+
+static inline void hiface_stats_sync_start(struct hiface_stats *stats,
+					   s64 error_us)
+{
+	s64 abs_us = error_us < 0 ? -error_us : error_us;
+
+	stats->sync_starts++;
+	stats->last_sync_error_us = error_us;
+	if (abs_us > stats->max_sync_error_us)
+		stats->max_sync_error_us = abs_us;
+}
+
+static inline void hiface_stats_panic(struct hiface_stats *stats,
+				      const char *reason, int err)
+{
+	stats->panic_reason = reason;
+	stats->panic_errno = err;
+	stats->panic_time = ktime_get();
+}
+#endif /* HIFACE_STATS_H */
@@ -0,0 +1,330 @@
+/*
+ * Linux driver for M2Tech hiFace compatible devices
+ *
+ * Copyright 2012-2013 (C) M2TECH S.r.l and Amarula Solutions B.V.
+ *
+ * Authors:  Michael Trimarchi <michael@amarulasolutions.com>
+ *           Antonio Ospite <ao2@amarulasolutions.com>
+ *
+ * The driver is based on the work done in TerraTec DMX 6Fire USB
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/version.h>
+
+#if defined(CONFIG_X86)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+#include <asm/fpu/api.h>
+#else
+#include <asm/i387.h>
+#endif
+#include <asm/cpufeature.h>
+#elif defined(CONFIG_ARM64) && defined(CONFIG_KERNEL_MODE_NEON)
+#include <asm/neon.h>
+#include <asm/simd.h>
+#endif
+
+#include "swap.h"
+
+/*
+ * The hardware wants word-swapped 32-bit values, every byte of audio goes
+ * through here in URB completion context.
+ *
+ * The vector variants only handle whole blocks and return how many bytes
+ * they did, hiface_swahw32_scalar finishes the tail. The SIMD register
+ * file is not saved across them, so they must run between
+ * simd_begin/simd_end.
+ */
+struct swap_impl {
+	const char *name;
+	unsigned int block;
+	bool (*available)(void);
+	unsigned int (*swap)(u8 *dest, const u8 *src, unsigned int n);
+};
+
+#if defined(CONFIG_X86)
+
+static inline bool simd_usable(void)
+{
+	return irq_fpu_usable();
+}
+
+static inline void simd_begin(void)
+{
+	kernel_fpu_begin();
+}
+
+static inline void simd_end(void)
+{
+	kernel_fpu_end();
+}
+
+/*
+ * The vector registers the blocks below write. The kernel is built with
+ * -mno-sse: gcc never allocates them then, and refuses them as clobbers.
+ * The userspace build in tools/ does allocate them.
+ */
+#ifdef __SSE__
+#define SWAP_XMM_CLOBBERS "xmm0", "xmm1", "xmm2", "xmm3", "xmm7",
+#define SWAP_YMM_CLOBBERS "ymm0", "ymm1", "ymm2", "ymm3", "ymm7",
+#else
+#define SWAP_XMM_CLOBBERS
+#define SWAP_YMM_CLOBBERS
+#endif
+
+/* pshufb mask swapping the 16-bit halves of each 32-bit word */
+static const u8 swahw32_mask[32] __aligned(32) = {
+	2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+	2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+};
+
+static bool sse2_available(void)
+{
+	return boot_cpu_has(X86_FEATURE_XMM2);
+}
+
+static unsigned int swap_sse2(u8 *dest, const u8 *src, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		asm volatile("movdqu   (%1), %%xmm0\n\t"
+			     "movdqu 16(%1), %%xmm1\n\t"
+			     "movdqu 32(%1), %%xmm2\n\t"
+			     "movdqu 48(%1), %%xmm3\n\t"
+			     "pshuflw $0xb1, %%xmm0, %%xmm0\n\t"
+			     "pshuflw $0xb1, %%xmm1, %%xmm1\n\t"
+			     "pshuflw $0xb1, %%xmm2, %%xmm2\n\t"
+			     "pshuflw $0xb1, %%xmm3, %%xmm3\n\t"
+			     "pshufhw $0xb1, %%xmm0, %%xmm0\n\t"
+			     "pshufhw $0xb1, %%xmm1, %%xmm1\n\t"
+			     "pshufhw $0xb1, %%xmm2, %%xmm2\n\t"
+			     "pshufhw $0xb1, %%xmm3, %%xmm3\n\t"
+			     "movdqu %%xmm0,   (%0)\n\t"
+			     "movdqu %%xmm1, 16(%0)\n\t"
+			     "movdqu %%xmm2, 32(%0)\n\t"
+			     "movdqu %%xmm3, 48(%0)\n\t"
+			     : : "r" (dest + i), "r" (src + i)
+			     : SWAP_XMM_CLOBBERS "memory");
+	}
+	return i;
+}
+
+static bool ssse3_available(void)
+{
+	return boot_cpu_has(X86_FEATURE_SSSE3);
+}
+
+static unsigned int swap_ssse3(u8 *dest, const u8 *src, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		asm volatile("movdqa %2, %%xmm7\n\t"
+			     "movdqu   (%1), %%xmm0\n\t"
+			     "movdqu 16(%1), %%xmm1\n\t"
+			     "movdqu 32(%1), %%xmm2\n\t"
+			     "movdqu 48(%1), %%xmm3\n\t"
+			     "pshufb %%xmm7, %%xmm0\n\t"
+			     "pshufb %%xmm7, %%xmm1\n\t"
+			     "pshufb %%xmm7, %%xmm2\n\t"
+			     "pshufb %%xmm7, %%xmm3\n\t"
+			     "movdqu %%xmm0,   (%0)\n\t"
+			     "movdqu %%xmm1, 16(%0)\n\t"
+			     "movdqu %%xmm2, 32(%0)\n\t"
+			     "movdqu %%xmm3, 48(%0)\n\t"
+			     : : "r" (dest + i), "r" (src + i),
+				 "m" (*(const u8 (*)[16])swahw32_mask)
+			     : SWAP_XMM_CLOBBERS "memory");
+	}
+	return i;
+}
+
+static bool avx2_available(void)
+{
+	return boot_cpu_has(X86_FEATURE_AVX2) &&
+	       boot_cpu_has(X86_FEATURE_OSXSAVE);
+}
+
+static unsigned int swap_avx2(u8 *dest, const u8 *src, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i + 128 <= n; i += 128) {
+		asm volatile("vmovdqa %2, %%ymm7\n\t"
+			     "vmovdqu   (%1), %%ymm0\n\t"
+			     "vmovdqu 32(%1), %%ymm1\n\t"
+			     "vmovdqu 64(%1), %%ymm2\n\t"
+			     "vmovdqu 96(%1), %%ymm3\n\t"
+			     "vpshufb %%ymm7, %%ymm0, %%ymm0\n\t"
+			     "vpshufb %%ymm7, %%ymm1, %%ymm1\n\t"
+			     "vpshufb %%ymm7, %%ymm2, %%ymm2\n\t"
+			     "vpshufb %%ymm7, %%ymm3, %%ymm3\n\t"
+			     "vmovdqu %%ymm0,   (%0)\n\t"
+			     "vmovdqu %%ymm1, 32(%0)\n\t"
+			     "vmovdqu %%ymm2, 64(%0)\n\t"
+			     "vmovdqu %%ymm3, 96(%0)\n\t"
+			     : : "r" (dest + i), "r" (src + i),
+				 "m" (*(const u8 (*)[32])swahw32_mask)
+			     : SWAP_YMM_CLOBBERS "memory");
+	}
+	asm volatile("vzeroupper" : : : "memory");
+	return i;
+}
+
+/* in order of preference, the last one passing the self-test wins */
+static const struct swap_impl swap_impls[] = {
+	{ "sse2", 64, sse2_available, swap_sse2 },
+	{ "ssse3", 64, ssse3_available, swap_ssse3 },
+	{ "avx2", 128, avx2_available, swap_avx2 },
+};
+
+#elif defined(CONFIG_ARM64) && defined(CONFIG_KERNEL_MODE_NEON)
+
+static inline bool simd_usable(void)
+{
+	return may_use_simd();
+}
+
+static inline void simd_begin(void)
+{
+	kernel_neon_begin();
+}
+
+static inline void simd_end(void)
+{
+	kernel_neon_end();
+}
+
+/* as on x86, -mgeneral-regs-only kernels cannot name them */
+#ifdef __ARM_NEON
+#define SWAP_NEON_CLOBBERS "v0", "v1", "v2", "v3",
+#else
+#define SWAP_NEON_CLOBBERS
+#endif
+
+static bool neon_available(void)
+{
+	return true; /* Advanced SIMD is mandatory on arm64 */
+}
+
+static unsigned int swap_neon(u8 *dest, const u8 *src, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		asm volatile("ld1 {v0.16b-v3.16b}, [%1]\n\t"
+			     "rev32 v0.8h, v0.8h\n\t"
+			     "rev32 v1.8h, v1.8h\n\t"
+			     "rev32 v2.8h, v2.8h\n\t"
+			     "rev32 v3.8h, v3.8h\n\t"
+			     "st1 {v0.16b-v3.16b}, [%0]\n\t"
+			     : : "r" (dest + i), "r" (src + i)
+			     : SWAP_NEON_CLOBBERS "memory");
+	}
+	return i;
+}
+
+static const struct swap_impl swap_impls[] = {
+	{ "neon", 64, neon_available, swap_neon },
+};
+
+#else
+
+static inline bool simd_usable(void)
+{
+	return false;
+}
+
+static inline void simd_begin(void)
+{
+}
+
+static inline void simd_end(void)
+{
+}
+
+static const struct swap_impl swap_impls[] = {};
+
+#endif
+
+static const struct swap_impl *swap_impl;
+
+void hiface_memcpy_swahw32(u8 *dest, const u8 *src, unsigned int n)
+{
+	const struct swap_impl *impl = swap_impl;
+	unsigned int done = 0;
+
+	if (impl && n >= impl->block && simd_usable()) {
+		simd_begin();
+		done = impl->swap(dest, src, n);
+		simd_end();
+	}
+	hiface_swahw32_scalar(dest + done, src + done, n - done);
+}
+
+void hiface_convert_s32(u8 *dest, const u8 *src, unsigned int n)
+{
+	hiface_memcpy_swahw32(dest, src, n * 4);
+}
+
+/* compare a vector variant with the scalar loop, unaligned and with a tail */
+#define SWAP_TEST_SIZE (4096 + 60)
+
+static bool hiface_swap_selftest(const struct swap_impl *impl, u8 *buf)
+{
+	u8 *src = buf + 4;
+	u8 *ref = buf + SWAP_TEST_SIZE + 8;
+	u8 *out = buf + 2 * SWAP_TEST_SIZE + 12;
+	unsigned int done;
+	unsigned int i;
+
+	for (i = 0; i < SWAP_TEST_SIZE; i++)
+		src[i] = i * 7 + (i >> 8);
+
+	hiface_swahw32_scalar(ref, src, SWAP_TEST_SIZE);
+
+	memset(out, 0, SWAP_TEST_SIZE);
+	simd_begin();
+	done = impl->swap(out, src, SWAP_TEST_SIZE);
+	simd_end();
+	hiface_swahw32_scalar(out + done, src + done, SWAP_TEST_SIZE - done);
+
+	return memcmp(ref, out, SWAP_TEST_SIZE) == 0;
+}
+
+void hiface_swap_init(void)
+{
+	u8 *buf;
+	int i;
+
+	swap_impl = NULL;
+
+	buf = kmalloc(3 * SWAP_TEST_SIZE + 16, GFP_KERNEL);
+	if (!buf)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(swap_impls); i++) {
+		const struct swap_impl *impl = &swap_impls[i];
+
+		if (!impl->available())
+			continue;
+
+		if (!hiface_swap_selftest(impl, buf)) {
+			pr_warn("%s word swap failed self-test\n", impl->name);
+			continue;
+		}
+		swap_impl = impl;
+	}
+	kfree(buf);
+
+	pr_info("using %s word swap\n", swap_impl ? swap_impl->name : "scalar");
+}
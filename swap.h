@@ -0,0 +1,27 @@
+/*
+ * Linux driver for M2Tech hiFace compatible devices
+ *
+ * Copyright 2012-2013 (C) M2TECH S.r.l and Amarula Solutions B.V.
+ *
+ * Authors:  Michael Trimarchi <michael@amarulasolutions.com>
+ *           Antonio Ospite <ao2@amarulasolutions.com>
+ *
+ * The driver is based on the work done in TerraTec DMX 6Fire USB
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef HIFACE_SWAP_H
+#define HIFACE_SWAP_H
+
+#include <linux/types.h>
+
+#include "core.h"
+
+void hiface_swap_init(void);
+void hiface_memcpy_swahw32(u8 *dest, const u8 *src, unsigned int n);
+void hiface_convert_s32(u8 *dest, const u8 *src, unsigned int n);
+#endif /* HIFACE_SWAP_H */
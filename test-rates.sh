@@ -2,11 +2,13 @@
 
 # Example command line:
 #   $ SPEAKER_TEST=.../alsa-utils/speaker-test/speaker-test EXTRA_RATES=1 ./test-rates.sh
+#   $ FORMAT=S24_3LE ./test-rates.sh
 
 set -e
 
 SPEAKER_TEST=${SPEAKER_TEST:-speaker-test}
 DEVICE=${DEVICE:-hw:1}
+FORMAT=${FORMAT:-S32_LE}
 
 EXTRA_RATES=${EXTRA_RATES:-0}
 
@@ -18,6 +20,6 @@ fi
 
 for rate in $SAMPLE_RATES;
 do
-  "$SPEAKER_TEST" -l 1 -D "$DEVICE" -c 2 -F S32_LE -r "$rate"
+  "$SPEAKER_TEST" -l 1 -D "$DEVICE" -c 2 -F "$FORMAT" -r "$rate"
   dmesg | tail -1
 done
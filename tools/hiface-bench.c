@@ -0,0 +1,216 @@
+/*
+ * Linux driver for M2Tech hiFace compatible devices
+ *
+ * Copyright 2012-2013 (C) M2TECH S.r.l and Amarula Solutions B.V.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Drives the streaming core of the driver, as built into the module, with
+ * synthetic ring and period geometries and reports the cost of filling
+ * one urb from the ring: ring split, sample conversion, ring and period
+ * advance. The /gain formats add the software volume at -6 dB, dithered.
+ * Bytes are counted on the device side, 4 per sample.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#include "core.h"
+#include "swap.h"
+
+#define FRAME_BYTES 8      /* device side, as PCM_FRAME_BYTES */
+#define PACKET_ALIGN 512   /* as PCM_PACKET_ALIGN */
+#define MAX_PACKET (128 * PACKET_ALIGN) /* as PCM_MAX_PACKET_SIZE */
+#define PACKET_SIZE 4096   /* as PCM_PACKET_SIZE, without a quantum */
+
+struct format {
+	const char *name;
+	unsigned int sample_bytes;
+	hiface_convert_t convert;
+	hiface_convert_gain_t convert_gain; /* with the software volume */
+};
+
+struct geometry {
+	unsigned int rate;
+	unsigned int quantum_us;
+	unsigned int period_frames;
+	unsigned int periods;
+};
+
+static void convert_s32_scalar(u8 *dest, const u8 *src, unsigned int n)
+{
+	hiface_swahw32_scalar(dest, src, n * 4);
+}
+
+static const struct format formats[] = {
+	{ "S16_LE", 2, hiface_convert_s16 },
+	{ "S24_LE", 4, hiface_convert_s24 },
+	{ "S24_3LE", 3, hiface_convert_s24_3 },
+	{ "S32_LE", 4, hiface_convert_s32 },
+	{ "S32_LE/scalar", 4, convert_s32_scalar },
+	{ "S16_LE/gain", 2, hiface_convert_s16, hiface_convert_gain_s16 },
+	{ "S32_LE/gain", 4, hiface_convert_s32, hiface_convert_gain_s32 },
+};
+
+static const struct geometry geometries[] = {
+	{ 44100, 0, 1024, 4 },
+	{ 44100, 4000, 1024, 4 },
+	{ 44100, 4000, 64, 4 },
+	{ 48000, 1000, 256, 8 },
+	{ 96000, 4000, 2048, 4 },
+	{ 192000, 4000, 4096, 2 },
+	{ 384000, 2000, 8192, 2 },
+	{ 384000, 20000, 16384, 2 },
+};
+
+/* same packet size as hiface_pcm_urb_geometry, on the device side */
+static unsigned int packet_bytes(const struct geometry *g)
+{
+	unsigned int size, period;
+
+	size = PACKET_SIZE;
+	if (g->quantum_us) {
+		size = (unsigned long long)g->rate * g->quantum_us / 1000000 *
+		       FRAME_BYTES;
+		size = (size + PACKET_ALIGN - 1) / PACKET_ALIGN * PACKET_ALIGN;
+		if (size > MAX_PACKET)
+			size = MAX_PACKET;
+	}
+
+	period = g->period_frames * FRAME_BYTES;
+	if (period >= PACKET_ALIGN && size > period / PACKET_ALIGN * PACKET_ALIGN)
+		size = period / PACKET_ALIGN * PACKET_ALIGN;
+	return size;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static volatile u32 sink;
+
+static void bench(const struct format *f, const struct geometry *g,
+		  unsigned int packets)
+{
+	unsigned int dev_bytes = packet_bytes(g);
+	unsigned int samples = dev_bytes / 4;
+	unsigned int src_bytes = samples * f->sample_bytes;
+	unsigned int frame_bytes = 2 * f->sample_bytes;
+	unsigned int period_bytes = g->period_frames * frame_bytes;
+	unsigned int ring_bytes = period_bytes * g->periods;
+	unsigned int off = 0, period_off = 0, elapsed = 0;
+	struct hiface_gain gain = {
+		.gain = { HIFACE_GAIN_UNITY / 2, HIFACE_GAIN_UNITY / 2 },
+		.dither = true,
+		.seed = 1,
+	};
+	unsigned int i;
+	double t0, t1;
+	u8 *ring, *dest;
+#ifdef HAVE_TSC
+	unsigned long long c0, c1;
+#endif
+
+	ring = malloc(ring_bytes);
+	dest = malloc(dev_bytes);
+	if (!ring || !dest) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < ring_bytes; i++)
+		ring[i] = i * 7 + (i >> 8);
+
+	/* warm up the caches and the branch predictors */
+	for (i = 0; i < ring_bytes / src_bytes + 1; i++)
+		off = hiface_ring_fill(dest, ring, ring_bytes, off, src_bytes,
+				       f->sample_bytes, f->convert,
+				       f->convert_gain,
+				       f->convert_gain ? &gain : NULL);
+
+	t0 = now_ns();
+#ifdef HAVE_TSC
+	c0 = __rdtsc();
+#endif
+	for (i = 0; i < packets; i++) {
+		off = hiface_ring_fill(dest, ring, ring_bytes, off, src_bytes,
+				       f->sample_bytes, f->convert,
+				       f->convert_gain,
+				       f->convert_gain ? &gain : NULL);
+		elapsed += hiface_period_advance(&period_off, period_bytes,
+						 src_bytes);
+	}
+#ifdef HAVE_TSC
+	c1 = __rdtsc();
+#endif
+	t1 = now_ns();
+	sink = ((u32 *)dest)[samples - 1] + elapsed;
+
+	printf("%-14s %6u %5u %5u %7u %6u %10.1f", f->name, g->rate,
+	       g->quantum_us, dev_bytes, ring_bytes, period_bytes,
+	       (t1 - t0) / packets);
+#ifdef HAVE_TSC
+	printf(" %8.2f\n", (double)dev_bytes * packets / (c1 - c0));
+#else
+	printf(" %8s\n", "-");
+#endif
+
+	free(dest);
+	free(ring);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-n packets] [-f format]\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int packets = 200000;
+	const char *only = NULL;
+	unsigned int i, j;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:f:")) != -1) {
+		switch (opt) {
+		case 'n':
+			packets = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			only = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!packets)
+		usage(argv[0]);
+
+	hiface_swap_init();
+
+	printf("%-14s %6s %5s %5s %7s %6s %10s %8s\n", "format", "rate",
+	       "us", "urb", "ring", "period", "ns/urb", "B/cycle");
+	for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+		if (only && strcmp(only, formats[i].name))
+			continue;
+		for (j = 0; j < sizeof(geometries) / sizeof(geometries[0]); j++)
+			bench(&formats[i], &geometries[j], packets);
+	}
+	return 0;
+}
@@ -0,0 +1,115 @@
+#!/bin/sh
+#
+# End to end benchmark of snd-usb-hiface against the device emulated by
+# hiface-gadget, over dummy_hcd: plays a counting S32_LE pattern at every
+# rate the driver supports and prints what the emulated device received,
+# see hiface-gadget.c for the report.
+#
+#   make -C tools && sudo tools/hiface-gadget-bench.sh [seconds per rate]
+#
+# Needs configfs, libcomposite, usb_f_fs, dummy_hcd and aplay. The module is
+# loaded from ../snd-usb-hiface.ko when it has been built there, otherwise
+# with modprobe. Any other gadget on dummy_udc.0 is in the way.
+
+set -e
+
+TOOLS=$(cd "$(dirname "$0")" && pwd)
+SECS=${1:-10}
+# the Young, the only one with the 352800 and 384000 rates
+VID=${VID:-0x04b4}
+PID=${PID:-0x0384}
+RATES="44100 48000 88200 96000 176400 192000 352800 384000"
+CARD=hifacebench
+GADGET=/sys/kernel/config/usb_gadget/hiface
+FFS=/dev/ffs-hiface
+LOG=$(mktemp)
+EMULATOR=
+
+cleanup() {
+	set +e
+	[ -e "$GADGET/UDC" ] && echo "" > "$GADGET/UDC" 2>/dev/null
+	if [ -n "$EMULATOR" ]; then
+		kill -INT "$EMULATOR"
+		wait "$EMULATOR"
+		STATUS=$?
+	fi
+	rmmod snd_usb_hiface 2>/dev/null
+	umount "$FFS" 2>/dev/null && rmdir "$FFS"
+	if [ -d "$GADGET" ]; then
+		rm -f "$GADGET/configs/c.1/ffs.hiface"
+		rmdir "$GADGET/configs/c.1/strings/0x409" \
+		      "$GADGET/configs/c.1" \
+		      "$GADGET/functions/ffs.hiface" \
+		      "$GADGET/strings/0x409" \
+		      "$GADGET" 2>/dev/null
+	fi
+	cat "$LOG"
+	rm -f "$LOG"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+modprobe libcomposite
+modprobe usb_f_fs
+modprobe dummy_hcd
+mountpoint -q /sys/kernel/config || mount -t configfs none /sys/kernel/config
+
+mkdir "$GADGET"
+echo "$VID" > "$GADGET/idVendor"
+echo "$PID" > "$GADGET/idProduct"
+mkdir "$GADGET/strings/0x409"
+echo "M2Tech" > "$GADGET/strings/0x409/manufacturer"
+echo "hiFace emulator" > "$GADGET/strings/0x409/product"
+mkdir "$GADGET/configs/c.1"
+mkdir "$GADGET/configs/c.1/strings/0x409"
+echo "hiFace" > "$GADGET/configs/c.1/strings/0x409/configuration"
+mkdir "$GADGET/functions/ffs.hiface"
+ln -s "$GADGET/functions/ffs.hiface" "$GADGET/configs/c.1/"
+
+mkdir -p "$FFS"
+mount -t functionfs hiface "$FFS"
+
+# keep_alive_ms=0 so that the stop latency is the driver's own
+rmmod snd_usb_hiface 2>/dev/null || true
+if [ -f "$TOOLS/../snd-usb-hiface.ko" ]; then
+	modprobe snd-pcm
+	insmod "$TOOLS/../snd-usb-hiface.ko" id=$CARD keep_alive_ms=0
+else
+	modprobe snd-usb-hiface id=$CARD keep_alive_ms=0
+fi
+
+"$TOOLS/hiface-gadget" "$FFS" > "$LOG" &
+EMULATOR=$!
+while [ ! -e "$FFS/ep1" ]; do
+	kill -0 "$EMULATOR"
+	sleep 0.1
+done
+echo dummy_udc.0 > "$GADGET/UDC"
+
+i=0
+while [ ! -e /proc/asound/$CARD ]; do
+	i=$((i + 1))
+	if [ $i -gt 50 ]; then
+		echo "no card from the emulated device" >&2
+		exit 1
+	fi
+	sleep 0.1
+done
+
+for rate in $RATES; do
+	"$TOOLS/hiface-gadget" -p $((rate * SECS)) |
+		aplay -q -D hw:$CARD -t raw -f S32_LE -c 2 -r "$rate"
+	# let the emulator see the end of the stream
+	sleep 1
+done
+
+STATS=$(ls -d /sys/kernel/debug/snd_usb_hiface/card* 2>/dev/null | head -n 1)
+if [ -n "$STATS" ]; then
+	echo "driver statistics:"
+	cat "$STATS/stats"
+fi
+
+STATUS=0
+cleanup
+trap - EXIT
+exit $STATUS
@@ -0,0 +1,537 @@
+/*
+ * Linux driver for M2Tech hiFace compatible devices
+ *
+ * Copyright 2012-2013 (C) M2TECH S.r.l and Amarula Solutions B.V.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * A hiFace device on FunctionFS, to run the module end to end without
+ * hardware, see hiface-gadget-bench.sh for the gadget setup over dummy_hcd.
+ *
+ * The emulated device has one vendor interface with the bulk OUT endpoint
+ * 0x02 and accepts the 0xb0 rate request. It consumes the bulk stream at
+ * the requested rate, one packet at a time, the way the real device NAKs
+ * the host until its fifo has room, so the host side is paced as it would
+ * be on hardware.
+ *
+ * Every stream, from a rate request to the end of the bulk traffic, is
+ * reported on stdout:
+ *  - the consumed byte rate against the nominal one,
+ *  - how late each packet arrived after the device clock asked for it,
+ *  - start latency, from the rate request to the first packet,
+ *  - stop latency, from the last non silent sample to the last packet,
+ *  - the payload check: S32_LE samples played from "hiface-gadget -p" are
+ *    word swapped back and must count up by one, silence aside.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/functionfs.h>
+
+#define SET_RATE_REQUEST 0xb0
+#define FRAME_BYTES      8   /* device side, as PCM_FRAME_BYTES */
+#define PACKET_BYTES     512 /* high-speed bulk wMaxPacketSize */
+#define IDLE_MS          300 /* no traffic this long ends a stream */
+#define LATE_US          1000
+
+/* htole32() and htole16() are not constant expressions */
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define LE32(x) (x)
+#define LE16(x) (x)
+#else
+#define LE32(x) __builtin_bswap32(x)
+#define LE16(x) __builtin_bswap16(x)
+#endif
+
+static const struct {
+	unsigned int value;
+	unsigned int rate;
+} rate_values[] = {
+	{ 0x43, 44100 },
+	{ 0x4b, 48000 },
+	{ 0x42, 88200 },
+	{ 0x4a, 96000 },
+	{ 0x40, 176400 },
+	{ 0x48, 192000 },
+	{ 0x58, 352800 },
+	{ 0x68, 384000 },
+};
+
+static const struct {
+	struct usb_functionfs_descs_head_v2 header;
+	__le32 fs_count;
+	__le32 hs_count;
+	struct {
+		struct usb_interface_descriptor intf;
+		struct usb_endpoint_descriptor_no_audio out;
+	} __attribute__((packed)) fs, hs;
+} __attribute__((packed)) descriptors = {
+	.header = {
+		.magic = LE32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2),
+		/* the rate request is addressed to "other", not to us */
+		.flags = LE32(FUNCTIONFS_HAS_FS_DESC |
+				 FUNCTIONFS_HAS_HS_DESC |
+				 FUNCTIONFS_ALL_CTRL_RECIP),
+		.length = LE32(sizeof(descriptors)),
+	},
+	.fs_count = LE32(2),
+	.hs_count = LE32(2),
+	.fs = {
+		.intf = {
+			.bLength = sizeof(descriptors.fs.intf),
+			.bDescriptorType = USB_DT_INTERFACE,
+			.bNumEndpoints = 1,
+			.bInterfaceClass = USB_CLASS_VENDOR_SPEC,
+			.iInterface = 1,
+		},
+		.out = {
+			.bLength = sizeof(descriptors.fs.out),
+			.bDescriptorType = USB_DT_ENDPOINT,
+			.bEndpointAddress = 2 | USB_DIR_OUT,
+			.bmAttributes = USB_ENDPOINT_XFER_BULK,
+			.wMaxPacketSize = LE16(64),
+		},
+	},
+	.hs = {
+		.intf = {
+			.bLength = sizeof(descriptors.hs.intf),
+			.bDescriptorType = USB_DT_INTERFACE,
+			.bNumEndpoints = 1,
+			.bInterfaceClass = USB_CLASS_VENDOR_SPEC,
+			.iInterface = 1,
+		},
+		.out = {
+			.bLength = sizeof(descriptors.hs.out),
+			.bDescriptorType = USB_DT_ENDPOINT,
+			.bEndpointAddress = 2 | USB_DIR_OUT,
+			.bmAttributes = USB_ENDPOINT_XFER_BULK,
+			.wMaxPacketSize = LE16(PACKET_BYTES),
+		},
+	},
+};
+
+#define INTERFACE_NAME "hiFace"
+
+static const struct {
+	struct usb_functionfs_strings_head header;
+	struct {
+		__le16 code;
+		char str[sizeof(INTERFACE_NAME)];
+	} __attribute__((packed)) lang0;
+} __attribute__((packed)) strings = {
+	.header = {
+		.magic = LE32(FUNCTIONFS_STRINGS_MAGIC),
+		.length = LE32(sizeof(strings)),
+		.str_count = LE32(1),
+		.lang_count = LE32(1),
+	},
+	.lang0 = {
+		LE16(0x0409),
+		INTERFACE_NAME,
+	},
+};
+
+struct stream {
+	bool running;
+	unsigned int rate;
+	double request;         /* rate request, s */
+	double first;           /* first packet */
+	double last;            /* last packet */
+	double last_sound;      /* last packet with a non silent sample */
+	unsigned long long bytes;
+	unsigned long long packets;
+
+	/* lateness of each packet against the device clock, us */
+	float *late;
+	size_t late_size;
+
+	/* payload check */
+	uint32_t expect;        /* next sample, 0 before the first one */
+	uint32_t first_sample;
+	uint32_t last_sample;
+	bool silent;            /* in silence after a sample */
+	unsigned long long verified;
+	unsigned long long errors;
+	unsigned int gaps;      /* silence between samples, underruns */
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stream cur;
+static unsigned int next_rate = 44100;  /* set by the last rate request */
+static double next_request;
+static unsigned int idle_ms = IDLE_MS;
+static unsigned int late_us = LATE_US;
+static unsigned int failed;
+static volatile sig_atomic_t quit;
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_until(double t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)t;
+	ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR && !quit)
+		;
+}
+
+static int cmp_float(const void *a, const void *b)
+{
+	float x = *(const float *)a, y = *(const float *)b;
+
+	return (x > y) - (x < y);
+}
+
+static float percentile(const float *v, size_t n, unsigned int pct)
+{
+	if (!n)
+		return 0;
+	return v[(n - 1) * pct / 100];
+}
+
+/* call with the lock held */
+static void stream_end(void)
+{
+	struct stream *s = &cur;
+	double duration = s->last - s->first;
+	double nominal = (double)s->rate * FRAME_BYTES;
+	double byte_rate = duration > 0 ? s->bytes / duration : 0;
+	unsigned long long late = 0;
+	size_t i;
+
+	if (!s->running)
+		return;
+
+	qsort(s->late, s->packets, sizeof(*s->late), cmp_float);
+	for (i = 0; i < s->packets; i++)
+		if (s->late[i] > late_us)
+			late++;
+
+	printf("rate %u: %llu frames in %.3f s, %.1f B/s (%.2f%%)\n",
+	       s->rate, s->bytes / FRAME_BYTES, duration, byte_rate,
+	       100 * byte_rate / nominal);
+	printf("  late: p50 %.0f us, p99 %.0f us, max %.0f us, %llu packets over %u us\n",
+	       percentile(s->late, s->packets, 50),
+	       percentile(s->late, s->packets, 99),
+	       percentile(s->late, s->packets, 100), late, late_us);
+	printf("  start %.3f ms, stop %.3f ms\n",
+	       (s->first - s->request) * 1e3,
+	       s->last_sound ? (s->last - s->last_sound) * 1e3 : 0.0);
+	printf("  payload: %llu samples %u..%u, %u gaps, %llu errors\n",
+	       s->verified, s->first_sample, s->last_sample, s->gaps,
+	       s->errors);
+	fflush(stdout);
+
+	if (s->errors)
+		failed++;
+
+	free(s->late);
+	memset(s, 0, sizeof(*s));
+}
+
+/* call with the lock held */
+static void stream_start(double now)
+{
+	cur.running = true;
+	cur.rate = next_rate;
+	cur.request = next_request ? next_request : now;
+	cur.first = now;
+	next_request = 0;
+}
+
+static void check_payload(struct stream *s, const uint8_t *buf, size_t len,
+			  double now)
+{
+	size_t i;
+
+	for (i = 0; i + 4 <= len; i += 4) {
+		uint32_t w = le32toh(*(const uint32_t *)(buf + i));
+		uint32_t v = w << 16 | w >> 16;
+
+		if (!v) {
+			s->silent = s->expect != 0;
+			continue;
+		}
+		s->last_sound = now;
+		if (s->silent) {
+			s->gaps++;
+			s->silent = false;
+		}
+		if (!s->expect) {
+			s->first_sample = v;
+		} else if (v != s->expect) {
+			if (!s->errors)
+				printf("  payload: %#x instead of %#x at sample %llu\n",
+				       v, s->expect, s->verified);
+			s->errors++;
+		}
+		s->verified++;
+		s->last_sample = v;
+		s->expect = v + 1;
+	}
+}
+
+static void stream_packet(const uint8_t *buf, size_t len, double now,
+			  double deadline)
+{
+	struct stream *s = &cur;
+
+	if (!s->running)
+		stream_start(now);
+
+	if (s->packets == s->late_size) {
+		s->late_size = s->late_size ? 2 * s->late_size : 4096;
+		s->late = realloc(s->late, s->late_size * sizeof(*s->late));
+		if (!s->late) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	s->late[s->packets++] = deadline ? (now - deadline) * 1e6 : 0;
+	s->bytes += len;
+	s->last = now;
+	check_payload(s, buf, len, now);
+}
+
+static unsigned int rate_of(unsigned int value)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(rate_values) / sizeof(rate_values[0]); i++)
+		if (rate_values[i].value == value)
+			return rate_values[i].rate;
+	return 0;
+}
+
+static void handle_setup(int ep0, const struct usb_ctrlrequest *setup)
+{
+	unsigned int rate;
+
+	if (setup->bRequestType != (USB_DIR_OUT | USB_TYPE_VENDOR |
+				    USB_RECIP_OTHER) ||
+	    setup->bRequest != SET_RATE_REQUEST ||
+	    !(rate = rate_of(le16toh(setup->wValue)))) {
+		fprintf(stderr, "stalling request %02x %02x %04x\n",
+			setup->bRequestType, setup->bRequest,
+			le16toh(setup->wValue));
+		/* a read on an IN request or a write on an OUT one stalls */
+		if (setup->bRequestType & USB_DIR_IN) {
+			if (read(ep0, NULL, 0) < 0) {
+				/* expected, the stall is the error */
+			}
+		} else if (write(ep0, NULL, 0) < 0) {
+			/* likewise */
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	stream_end();
+	next_rate = rate;
+	next_request = now_s();
+	pthread_mutex_unlock(&lock);
+
+	/* status stage, the device has no data to send back */
+	if (read(ep0, NULL, 0) < 0)
+		perror("ack rate request");
+}
+
+static void *ep0_thread(void *arg)
+{
+	int ep0 = *(int *)arg;
+	struct usb_functionfs_event ev[4];
+	ssize_t n;
+	int i;
+
+	for (;;) {
+		n = read(ep0, ev, sizeof(ev));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("ep0");
+			exit(1);
+		}
+		for (i = 0; i < n / (ssize_t)sizeof(ev[0]); i++)
+			if (ev[i].type == FUNCTIONFS_SETUP)
+				handle_setup(ep0, &ev[i].u.setup);
+	}
+	return NULL;
+}
+
+static void *idle_thread(void *arg)
+{
+	for (;;) {
+		usleep(idle_ms * 1000 / 4);
+		pthread_mutex_lock(&lock);
+		if (cur.running && now_s() - cur.last > idle_ms / 1e3)
+			stream_end();
+		pthread_mutex_unlock(&lock);
+	}
+	return NULL;
+}
+
+static int open_ep(const char *dir, const char *name, int flags)
+{
+	char path[256];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	fd = open(path, flags);
+	if (fd < 0) {
+		perror(path);
+		exit(1);
+	}
+	return fd;
+}
+
+static void on_signal(int sig)
+{
+	quit = 1;
+}
+
+static int emulate(const char *dir)
+{
+	static uint8_t buf[PACKET_BYTES];
+	struct sigaction sa;
+	sigset_t set;
+	pthread_t t;
+	int ep0, ep1;
+
+	ep0 = open_ep(dir, "ep0", O_RDWR);
+	if (write(ep0, &descriptors, sizeof(descriptors)) < 0 ||
+	    write(ep0, &strings, sizeof(strings)) < 0) {
+		perror("writing descriptors");
+		return 1;
+	}
+	ep1 = open_ep(dir, "ep1", O_RDONLY);
+
+	/* only the main thread takes the signals, so that the read stops */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	if (pthread_create(&t, NULL, ep0_thread, &ep0) ||
+	    pthread_create(&t, NULL, idle_thread, NULL)) {
+		fprintf(stderr, "cannot start the threads\n");
+		return 1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+	printf("ready\n");
+	fflush(stdout);
+
+	while (!quit) {
+		double deadline = 0;
+		ssize_t n;
+
+		/* the device clock asks for the next packet */
+		pthread_mutex_lock(&lock);
+		if (cur.running)
+			deadline = cur.first + (double)cur.bytes /
+				   (cur.rate * FRAME_BYTES);
+		pthread_mutex_unlock(&lock);
+		if (deadline)
+			sleep_until(deadline);
+
+		n = read(ep1, buf, sizeof(buf));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			/* not configured, or disabled under us */
+			usleep(10000);
+			continue;
+		}
+
+		pthread_mutex_lock(&lock);
+		/* the stream may have been ended while the read was blocked */
+		if (!cur.running)
+			deadline = 0;
+		stream_packet(buf, n, now_s(), deadline);
+		pthread_mutex_unlock(&lock);
+	}
+
+	pthread_mutex_lock(&lock);
+	stream_end();
+	pthread_mutex_unlock(&lock);
+	return failed ? 2 : 0;
+}
+
+/* S32_LE stereo frames whose samples count up from 1 */
+static int pattern(unsigned long long frames)
+{
+	static uint32_t buf[4096];
+	uint32_t sample = 1;
+	size_t i;
+
+	while (frames) {
+		size_t n = frames < sizeof(buf) / 8 ? frames * 2 :
+			   sizeof(buf) / 4;
+
+		for (i = 0; i < n; i++)
+			buf[i] = htole32(sample++);
+		if (fwrite(buf, 4, n, stdout) != n)
+			return 1;
+		frames -= n / 2;
+	}
+	return fflush(stdout) ? 1 : 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-i idle_ms] [-l late_us] <functionfs mount>\n"
+		"       %s -p frames\n", name, name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:l:p:")) != -1) {
+		switch (opt) {
+		case 'i':
+			idle_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			late_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			return pattern(strtoull(optarg, NULL, 0));
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || !idle_ms)
+		usage(argv[0]);
+
+	return emulate(argv[optind]);
+}
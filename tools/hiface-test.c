@@ -0,0 +1,394 @@
+/*
+ * Linux driver for M2Tech hiFace compatible devices
+ *
+ * Copyright 2012-2013 (C) M2TECH S.r.l and Amarula Solutions B.V.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Checks the streaming core of the driver, as built into the module: ring
+ * span and advance, period accounting, position interpolation and delay,
+ * the sample converters, the software volume and the ring fill across the
+ * wrap. Exits non-zero if any check fails, see "make -C tools check".
+ *
+ * Nothing here runs urbs or alsa: trigger, prepare, stop/start ordering,
+ * suspend and recovery are left to tools/hiface-gadget-bench.sh.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/kernel.h>
+
+#include "core.h"
+#include "swap.h"
+
+static unsigned int failures;
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: %s: check failed: %s\n", \
+				__FILE__, __LINE__, __func__, #cond);	\
+			failures++;					\
+		}							\
+	} while (0)
+
+/* the device takes left-aligned 32-bit samples, word-swapped */
+static u32 dev(u32 left)
+{
+	return swahw32(left);
+}
+
+static void fill_pattern(u8 *buf, unsigned int bytes)
+{
+	unsigned int i;
+
+	for (i = 0; i < bytes; i++)
+		buf[i] = i * 7 + (i >> 8) + 1;
+}
+
+static void test_ring_span(void)
+{
+	CHECK(hiface_ring_span(100, 0, 20) == 20);
+	CHECK(hiface_ring_span(100, 80, 20) == 20);
+	CHECK(hiface_ring_span(100, 90, 20) == 10);
+	CHECK(hiface_ring_span(100, 99, 100) == 1);
+}
+
+static void test_ring_advance(void)
+{
+	CHECK(hiface_ring_advance(100, 0, 20) == 20);
+	CHECK(hiface_ring_advance(100, 80, 20) == 0);
+	CHECK(hiface_ring_advance(100, 90, 20) == 10);
+	CHECK(hiface_ring_advance(100, 0, 100) == 0);
+	CHECK(hiface_ring_advance(100, 50, 100) == 50);
+}
+
+static void test_ring_distance(void)
+{
+	CHECK(hiface_ring_distance(100, 10, 30) == 20);
+	CHECK(hiface_ring_distance(100, 50, 50) == 0);
+	CHECK(hiface_ring_distance(100, 90, 10) == 20);
+	CHECK(hiface_ring_distance(100, 99, 0) == 1);
+}
+
+/* 1 ms at 48 kHz is 48 frames */
+static void test_position_interpolate(void)
+{
+	/* nothing handed over: stays put whatever the time */
+	CHECK(hiface_position_interpolate(1000, 200, 200, 1000000,
+					  48000) == 200);
+
+	CHECK(hiface_position_interpolate(1000, 100, 600, 0, 48000) == 100);
+	CHECK(hiface_position_interpolate(1000, 100, 600, 1000000,
+					  48000) == 148);
+
+	/* never past the data handed over */
+	CHECK(hiface_position_interpolate(1000, 100, 600, 20000000,
+					  48000) == 600);
+
+	/* across the wrap */
+	CHECK(hiface_position_interpolate(1000, 980, 80, 1000000,
+					  48000) == 28);
+	CHECK(hiface_position_interpolate(1000, 980, 80, 1000000000,
+					  48000) == 80);
+}
+
+static void test_position_interpolate_clamp(void)
+{
+	/* a clock going back counts as no time */
+	CHECK(hiface_position_interpolate(1000, 100, 600, -1000000,
+					  48000) == 100);
+
+	/* more than a second counts as one */
+	CHECK(hiface_position_interpolate(1000000, 0, 900000, 5000000000LL,
+					  192000) == 192000);
+
+	/* no rate, no progress */
+	CHECK(hiface_position_interpolate(1000, 100, 600, 1000000, 0) == 100);
+}
+
+static void test_position_delay(void)
+{
+	CHECK(hiface_position_delay(1000, 100, 300, 400) == 200);
+	CHECK(hiface_position_delay(1000, 100, 300, 200) == 0);
+	CHECK(hiface_position_delay(1000, 100, 300, 100) == 0);
+	CHECK(hiface_position_delay(1000, 100, 100, 0) == 0);
+
+	/* across the wrap */
+	CHECK(hiface_position_delay(1000, 900, 100, 500) == 300);
+}
+
+static void test_period_advance(void)
+{
+	unsigned int off = 0;
+
+	CHECK(hiface_period_advance(&off, 1000, 0) == 0 && off == 0);
+	CHECK(hiface_period_advance(&off, 1000, 999) == 0 && off == 999);
+	CHECK(hiface_period_advance(&off, 1000, 1) == 1 && off == 0);
+
+	/* one urb may cover several periods */
+	CHECK(hiface_period_advance(&off, 1000, 2500) == 2 && off == 500);
+	CHECK(hiface_period_advance(&off, 1000, 600) == 1 && off == 100);
+}
+
+/*
+ * A period of 1024 S16 stereo frames is 4096 bytes. It was once compared
+ * against the frame count, which made 4096 bytes four periods.
+ */
+static void test_period_bytes_not_frames(void)
+{
+	unsigned int period_frames = 1024, frame_bytes = 4;
+	unsigned int off = 0;
+
+	CHECK(hiface_period_advance(&off, period_frames * frame_bytes,
+				    4096) == 1);
+	CHECK(off == 0);
+	CHECK(hiface_period_advance(&off, period_frames * frame_bytes,
+				    period_frames) == 0);
+	CHECK(off == period_frames);
+}
+
+static void test_convert_s16(void)
+{
+	const s16 src[] = { 0, 1, -1, 0x7fff, -0x8000, 0x1234 };
+	u32 out[ARRAY_SIZE(src)];
+	unsigned int i;
+
+	hiface_convert_s16((u8 *)out, (const u8 *)src, ARRAY_SIZE(src));
+	for (i = 0; i < ARRAY_SIZE(src); i++)
+		CHECK(out[i] == dev((u32)src[i] << 16));
+}
+
+static void test_convert_s24(void)
+{
+	/* the top byte of the container is ignored */
+	const u32 src[] = { 0, 1, 0xffffff, 0x7fffff, 0x800000, 0xab123456 };
+	u32 out[ARRAY_SIZE(src)];
+	unsigned int i;
+
+	hiface_convert_s24((u8 *)out, (const u8 *)src, ARRAY_SIZE(src));
+	for (i = 0; i < ARRAY_SIZE(src); i++)
+		CHECK(out[i] == dev(src[i] << 8));
+}
+
+static void test_convert_s24_3(void)
+{
+	const u8 src[] = { 0x56, 0x34, 0x12, 0xff, 0xff, 0xff,
+			   0x00, 0x00, 0x80, 0x01, 0x00, 0x00 };
+	u32 out[ARRAY_SIZE(src) / 3];
+	unsigned int i;
+
+	hiface_convert_s24_3((u8 *)out, src, ARRAY_SIZE(out));
+	for (i = 0; i < ARRAY_SIZE(out); i++)
+		CHECK(out[i] == dev(src[3 * i] << 8 | src[3 * i + 1] << 16 |
+				    (u32)src[3 * i + 2] << 24));
+}
+
+/* odd lengths leave a tail to the scalar loop after the vector blocks */
+static void test_convert_s32(void)
+{
+	static const unsigned int lengths[] = { 1, 3, 4, 7, 64, 1027 };
+	u32 src[1027], out[1028], ref[1027];
+	unsigned int i, j;
+
+	fill_pattern((u8 *)src, sizeof(src));
+	for (i = 0; i < ARRAY_SIZE(lengths); i++) {
+		unsigned int n = lengths[i];
+
+		memset(out, 0, sizeof(out));
+		hiface_convert_s32((u8 *)out, (const u8 *)src, n);
+		hiface_swahw32_scalar((u8 *)ref, (const u8 *)src, n * 4);
+		for (j = 0; j < n; j++)
+			CHECK(ref[j] == dev(src[j]));
+		CHECK(!memcmp(out, ref, n * 4));
+		CHECK(out[n] == 0);
+	}
+}
+
+static void test_gain_unity(void)
+{
+	struct hiface_gain gain = {
+		.gain = { HIFACE_GAIN_UNITY, HIFACE_GAIN_UNITY },
+	};
+	u8 src[64 * 4];
+	u32 out[64], ref[64];
+
+	fill_pattern(src, sizeof(src));
+
+	hiface_convert_s16((u8 *)ref, src, 64);
+	hiface_convert_gain_s16((u8 *)out, src, 64, &gain);
+	CHECK(!memcmp(out, ref, sizeof(out)));
+
+	hiface_convert_s24((u8 *)ref, src, 64);
+	hiface_convert_gain_s24((u8 *)out, src, 64, &gain);
+	CHECK(!memcmp(out, ref, sizeof(out)));
+
+	hiface_convert_s24_3((u8 *)ref, src, 64);
+	hiface_convert_gain_s24_3((u8 *)out, src, 64, &gain);
+	CHECK(!memcmp(out, ref, sizeof(out)));
+
+	hiface_convert_s32((u8 *)ref, src, 64);
+	hiface_convert_gain_s32((u8 *)out, src, 64, &gain);
+	CHECK(!memcmp(out, ref, sizeof(out)));
+}
+
+static void test_gain_mute(void)
+{
+	struct hiface_gain gain = { .gain = { 0, 0 }, .dither = true };
+	u8 src[16 * 4];
+	u32 out[16];
+	unsigned int i;
+
+	fill_pattern(src, sizeof(src));
+	memset(out, 0xaa, sizeof(out));
+	hiface_convert_gain_s32((u8 *)out, src, 16, &gain);
+	for (i = 0; i < 16; i++)
+		CHECK(out[i] == 0);
+}
+
+/* gain[0] is the left channel, the even samples */
+static void test_gain_half(void)
+{
+	const s32 src[] = { 0x40000000, 0x40000000, -0x40000000, 0x1234 };
+	struct hiface_gain gain = {
+		.gain = { HIFACE_GAIN_UNITY / 2, 0 },
+	};
+	u32 out[ARRAY_SIZE(src)];
+
+	hiface_convert_gain_s32((u8 *)out, (const u8 *)src, ARRAY_SIZE(src),
+				&gain);
+	CHECK(out[0] == dev(0x20000000));
+	CHECK(out[1] == 0);
+	CHECK(out[2] == dev((u32)-0x20000000));
+	CHECK(out[3] == 0);
+}
+
+/* dithered samples are cut to 24 bits and clamped, not wrapped */
+static void test_gain_dither(void)
+{
+	struct hiface_gain gain = {
+		.gain = { HIFACE_GAIN_UNITY, HIFACE_GAIN_UNITY },
+		.dither = true,
+		.seed = 1,
+	};
+	s32 src[256];
+	u32 out[256];
+	unsigned int i;
+
+	for (i = 0; i < 256; i += 2) {
+		src[i] = 0x7fffff00;
+		src[i + 1] = -0x7fffff00 - 0x100;
+	}
+	hiface_convert_gain_s32((u8 *)out, (const u8 *)src, 256, &gain);
+	for (i = 0; i < 256; i++) {
+		s32 v = (s32)swahw32(out[i]);
+
+		CHECK((v & 0xff) == 0);
+		if (i & 1)
+			CHECK(v <= -0x7fffff00);
+		else
+			CHECK(v >= 0x7ffffe00);
+	}
+	CHECK(gain.seed != 1);
+}
+
+/* fill one packet from off, with and without the wrap, against a copy */
+static void check_ring_fill(unsigned int sample_bytes,
+			    hiface_convert_t convert,
+			    hiface_convert_gain_t convert_gain,
+			    unsigned int ring_bytes, unsigned int off,
+			    unsigned int bytes)
+{
+	struct hiface_gain unity = {
+		.gain = { HIFACE_GAIN_UNITY, HIFACE_GAIN_UNITY },
+	};
+	unsigned int samples = bytes / sample_bytes;
+	u8 ring[480], linear[480];
+	u32 out[120], ref[120];
+	unsigned int len, next;
+
+	fill_pattern(ring, ring_bytes);
+	len = hiface_ring_span(ring_bytes, off, bytes);
+	memcpy(linear, ring + off, len);
+	memcpy(linear + len, ring, bytes - len);
+	convert((u8 *)ref, linear, samples);
+
+	memset(out, 0, sizeof(out));
+	next = hiface_ring_fill((u8 *)out, ring, ring_bytes, off, bytes,
+				sample_bytes, convert, convert_gain, NULL);
+	CHECK(next == hiface_ring_advance(ring_bytes, off, bytes));
+	CHECK(!memcmp(out, ref, samples * 4));
+
+	memset(out, 0, sizeof(out));
+	next = hiface_ring_fill((u8 *)out, ring, ring_bytes, off, bytes,
+				sample_bytes, convert, convert_gain, &unity);
+	CHECK(next == hiface_ring_advance(ring_bytes, off, bytes));
+	CHECK(!memcmp(out, ref, samples * 4));
+}
+
+static void test_ring_fill(void)
+{
+	/* no wrap, ending on the wrap, across it */
+	check_ring_fill(2, hiface_convert_s16, hiface_convert_gain_s16,
+			64, 0, 32);
+	check_ring_fill(2, hiface_convert_s16, hiface_convert_gain_s16,
+			64, 32, 32);
+	check_ring_fill(2, hiface_convert_s16, hiface_convert_gain_s16,
+			64, 56, 16);
+	check_ring_fill(4, hiface_convert_s24, hiface_convert_gain_s24,
+			128, 120, 32);
+	check_ring_fill(4, hiface_convert_s32, hiface_convert_gain_s32,
+			480, 400, 400);
+
+	/* 3-byte samples: 6-byte frames, the wrap is not on a 4-byte bound */
+	check_ring_fill(3, hiface_convert_s24_3, hiface_convert_gain_s24_3,
+			60, 54, 12);
+	check_ring_fill(3, hiface_convert_s24_3, hiface_convert_gain_s24_3,
+			474, 6, 360);
+}
+
+static const struct {
+	const char *name;
+	void (*run)(void);
+} tests[] = {
+	{ "ring_span", test_ring_span },
+	{ "ring_advance", test_ring_advance },
+	{ "ring_distance", test_ring_distance },
+	{ "position_interpolate", test_position_interpolate },
+	{ "position_interpolate_clamp", test_position_interpolate_clamp },
+	{ "position_delay", test_position_delay },
+	{ "period_advance", test_period_advance },
+	{ "period_bytes_not_frames", test_period_bytes_not_frames },
+	{ "convert_s16", test_convert_s16 },
+	{ "convert_s24", test_convert_s24 },
+	{ "convert_s24_3", test_convert_s24_3 },
+	{ "convert_s32", test_convert_s32 },
+	{ "gain_unity", test_gain_unity },
+	{ "gain_mute", test_gain_mute },
+	{ "gain_half", test_gain_half },
+	{ "gain_dither", test_gain_dither },
+	{ "ring_fill", test_ring_fill },
+};
+
+int main(void)
+{
+	unsigned int i, before;
+
+	hiface_swap_init();
+
+	for (i = 0; i < ARRAY_SIZE(tests); i++) {
+		before = failures;
+		tests[i].run();
+		printf("%-4s %s\n", failures == before ? "ok" : "FAIL",
+		       tests[i].name);
+	}
+	if (failures)
+		fprintf(stderr, "%u checks failed\n", failures);
+	return failures ? 1 : 0;
+}
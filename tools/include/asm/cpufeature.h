@@ -0,0 +1,13 @@
+/* userspace stand-in for the kernel header, see tools/Makefile */
+#ifndef HIFACE_TOOLS_ASM_CPUFEATURE_H
+#define HIFACE_TOOLS_ASM_CPUFEATURE_H
+
+/* gcc checks the os support of the avx state along with the cpu */
+#define X86_FEATURE_XMM2    __builtin_cpu_supports("sse2")
+#define X86_FEATURE_SSSE3   __builtin_cpu_supports("ssse3")
+#define X86_FEATURE_AVX2    __builtin_cpu_supports("avx2")
+#define X86_FEATURE_OSXSAVE 1
+
+#define boot_cpu_has(feature) (feature)
+
+#endif
@@ -0,0 +1,21 @@
+/* userspace stand-in for the kernel header, see tools/Makefile */
+#ifndef HIFACE_TOOLS_ASM_FPU_API_H
+#define HIFACE_TOOLS_ASM_FPU_API_H
+
+#include <stdbool.h>
+
+/* the vector registers are always ours in userspace */
+static inline bool irq_fpu_usable(void)
+{
+	return true;
+}
+
+static inline void kernel_fpu_begin(void)
+{
+}
+
+static inline void kernel_fpu_end(void)
+{
+}
+
+#endif
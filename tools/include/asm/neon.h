@@ -0,0 +1,13 @@
+/* userspace stand-in for the kernel header, see tools/Makefile */
+#ifndef HIFACE_TOOLS_ASM_NEON_H
+#define HIFACE_TOOLS_ASM_NEON_H
+
+static inline void kernel_neon_begin(void)
+{
+}
+
+static inline void kernel_neon_end(void)
+{
+}
+
+#endif
@@ -0,0 +1,12 @@
+/* userspace stand-in for the kernel header, see tools/Makefile */
+#ifndef HIFACE_TOOLS_ASM_SIMD_H
+#define HIFACE_TOOLS_ASM_SIMD_H
+
+#include <stdbool.h>
+
+static inline bool may_use_simd(void)
+{
+	return true;
+}
+
+#endif
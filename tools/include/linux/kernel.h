@@ -0,0 +1,19 @@
+/* userspace stand-in for the kernel header, see tools/Makefile */
+#ifndef HIFACE_TOOLS_LINUX_KERNEL_H
+#define HIFACE_TOOLS_LINUX_KERNEL_H
+
+#include <stdio.h>
+#include <string.h>
+#include <linux/swab.h>
+#include <linux/types.h>
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define __aligned(x) __attribute__((aligned(x)))
+
+#ifndef pr_fmt
+#define pr_fmt(fmt) fmt
+#endif
+#define pr_info(fmt, ...) fprintf(stderr, pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_warn(fmt, ...) fprintf(stderr, pr_fmt(fmt), ##__VA_ARGS__)
+
+#endif
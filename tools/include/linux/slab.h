@@ -0,0 +1,11 @@
+/* userspace stand-in for the kernel header, see tools/Makefile */
+#ifndef HIFACE_TOOLS_LINUX_SLAB_H
+#define HIFACE_TOOLS_LINUX_SLAB_H
+
+#include <stdlib.h>
+
+#define GFP_KERNEL 0
+#define kmalloc(size, flags) malloc(size)
+#define kfree(ptr) free(ptr)
+
+#endif
@@ -0,0 +1,12 @@
+/* userspace stand-in for the kernel header, see tools/Makefile */
+#ifndef HIFACE_TOOLS_LINUX_SWAB_H
+#define HIFACE_TOOLS_LINUX_SWAB_H
+
+#include <linux/types.h>
+
+static inline u32 swahw32(u32 x)
+{
+	return x << 16 | x >> 16;
+}
+
+#endif
@@ -0,0 +1,7 @@
+/* userspace stand-in for the kernel header, see tools/Makefile */
+#ifndef HIFACE_TOOLS_LINUX_TIME_H
+#define HIFACE_TOOLS_LINUX_TIME_H
+
+#define NSEC_PER_SEC 1000000000L
+
+#endif
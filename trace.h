@@ -0,0 +1,144 @@
+/*
+ * Linux driver for M2Tech hiFace compatible devices
+ *
+ * Copyright 2012-2013 (C) M2TECH S.r.l and Amarula Solutions B.V.
+ *
+ * Authors:  Michael Trimarchi <michael@amarulasolutions.com>
+ *           Antonio Ospite <ao2@amarulasolutions.com>
+ *
+ * The driver is based on the work done in TerraTec DMX 6Fire USB
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM snd_usb_hiface
+
+#if !defined(HIFACE_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define HIFACE_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(hiface_urb_complete,
+	TP_PROTO(int card, unsigned int urb, int status,
+		 unsigned int dma_off, unsigned int period_off),
+	TP_ARGS(card, urb, status, dma_off, period_off),
+	TP_STRUCT__entry(
+		__field(int, card)
+		__field(unsigned int, urb)
+		__field(int, status)
+		__field(unsigned int, dma_off)
+		__field(unsigned int, period_off)
+	),
+	TP_fast_assign(
+		__entry->card = card;
+		__entry->urb = urb;
+		__entry->status = status;
+		__entry->dma_off = dma_off;
+		__entry->period_off = period_off;
+	),
+	TP_printk("card%d urb %u status %d dma_off %#x period_off %u",
+		  __entry->card, __entry->urb, __entry->status,
+		  __entry->dma_off, __entry->period_off)
+);
+
+TRACE_EVENT(hiface_urb_submit,
+	TP_PROTO(int card, unsigned int urb, unsigned int length, int ret),
+	TP_ARGS(card, urb, length, ret),
+	TP_STRUCT__entry(
+		__field(int, card)
+		__field(unsigned int, urb)
+		__field(unsigned int, length)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->card = card;
+		__entry->urb = urb;
+		__entry->length = length;
+		__entry->ret = ret;
+	),
+	TP_printk("card%d urb %u length %u ret %d",
+		  __entry->card, __entry->urb, __entry->length, __entry->ret)
+);
+
+TRACE_EVENT(hiface_period_elapsed,
+	TP_PROTO(int card, unsigned int periods, unsigned int dma_off),
+	TP_ARGS(card, periods, dma_off),
+	TP_STRUCT__entry(
+		__field(int, card)
+		__field(unsigned int, periods)
+		__field(unsigned int, dma_off)
+	),
+	TP_fast_assign(
+		__entry->card = card;
+		__entry->periods = periods;
+		__entry->dma_off = dma_off;
+	),
+	TP_printk("card%d periods %u dma_off %#x", __entry->card,
+		  __entry->periods, __entry->dma_off)
+);
+
+TRACE_EVENT(hiface_pointer,
+	TP_PROTO(int card, unsigned long pos),
+	TP_ARGS(card, pos),
+	TP_STRUCT__entry(
+		__field(int, card)
+		__field(unsigned long, pos)
+	),
+	TP_fast_assign(
+		__entry->card = card;
+		__entry->pos = pos;
+	),
+	TP_printk("card%d pos %lu", __entry->card, __entry->pos)
+);
+
+TRACE_EVENT(hiface_trigger,
+	TP_PROTO(int card, int cmd),
+	TP_ARGS(card, cmd),
+	TP_STRUCT__entry(
+		__field(int, card)
+		__field(int, cmd)
+	),
+	TP_fast_assign(
+		__entry->card = card;
+		__entry->cmd = cmd;
+	),
+	TP_printk("card%d %s", __entry->card,
+		  __print_symbolic(__entry->cmd,
+				   { SNDRV_PCM_TRIGGER_STOP, "stop" },
+				   { SNDRV_PCM_TRIGGER_START, "start" },
+				   { SNDRV_PCM_TRIGGER_PAUSE_PUSH, "pause" },
+				   { SNDRV_PCM_TRIGGER_PAUSE_RELEASE, "unpause" },
+				   { SNDRV_PCM_TRIGGER_SUSPEND, "suspend" },
+				   { SNDRV_PCM_TRIGGER_RESUME, "resume" }))
+);
+
+/* the values are the STREAM_XXX states of pcm.c */
+TRACE_EVENT(hiface_stream_state,
+	TP_PROTO(int card, u8 old_state, u8 new_state),
+	TP_ARGS(card, old_state, new_state),
+	TP_STRUCT__entry(
+		__field(int, card)
+		__field(u8, old_state)
+		__field(u8, new_state)
+	),
+	TP_fast_assign(
+		__entry->card = card;
+		__entry->old_state = old_state;
+		__entry->new_state = new_state;
+	),
+	TP_printk("card%d %u -> %u", __entry->card,
+		  __entry->old_state, __entry->new_state)
+);
+
+#endif /* HIFACE_TRACE_H */
+
+/* the header is found through -I$(src), see the Makefile */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>